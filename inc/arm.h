@@ -2,6 +2,7 @@
 #define INC_ARM_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 static inline void
 delay(int32_t count)
@@ -67,12 +68,47 @@ disb()
     asm volatile("dsb sy; isb");
 }
 
+/* Cortex-A53 data cache line size. */
+#define CACHE_LINE 64
+
 /* Data cache clean and invalidate by virtual address to point of coherency. */
 static inline void
 dccivac(void *p, int n)
 {
-    while (n--)
-        asm volatile("dc civac, %[x]" : : [x]"r"(p + n));
+    uint64_t a = (uint64_t)p & ~(uint64_t)(CACHE_LINE - 1);
+
+    for (; a < (uint64_t)p + n; a += CACHE_LINE)
+        asm volatile("dc civac, %[x]" : : [x]"r"(a));
+}
+
+/*
+ * CRC32C (Castagnoli) of n bytes at p with the ARMv8 CRC instructions,
+ * continuing from crc, which is 0 to start.  Chains like zlib's crc32().
+ */
+static inline uint32_t
+crc32c(uint32_t crc, const void* p, size_t n)
+{
+    const uint8_t* b = p;
+    uint64_t x;
+
+    crc = ~crc;
+    for (; n && ((uint64_t)b & 7); n--, b++)
+        asm("crc32cb %w[c], %w[c], %w[v]" : [c]"+r"(crc) : [v]"r"((uint32_t)*b));
+    for (; n >= 8; n -= 8, b += 8) {
+        x = *(const uint64_t*)b;
+        asm("crc32cx %w[c], %w[c], %x[v]" : [c]"+r"(crc) : [v]"r"(x));
+    }
+    for (; n; n--, b++)
+        asm("crc32cb %w[c], %w[c], %w[v]" : [c]"+r"(crc) : [v]"r"((uint32_t)*b));
+    return ~crc;
+}
+
+/* Count trailing zeros of a nonzero x, with RBIT and CLZ. */
+static inline int
+ctz64(uint64_t x)
+{
+    asm("rbit %[x], %[x]; clz %[x], %[x]" : [x]"+r"(x));
+    return x;
 }
 
 /* Read Exception Syndrome Register (EL1). */
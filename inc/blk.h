@@ -0,0 +1,101 @@
+#ifndef INC_BLK_H
+#define INC_BLK_H
+
+#include <stdint.h>
+#include "spinlock.h"
+#include "buf.h"
+#include "blktrace.h"
+
+/*
+ * Deadline I/O scheduler tunables.  A request waiting longer than its
+ * expiry time is dispatched next regardless of the elevator position,
+ * and waiting writes are dispatched after at most BLK_WRITES_STARVED
+ * read batches in a row.
+ */
+#define BLK_READ_EXPIRE     50      /* ms */
+#define BLK_WRITE_EXPIRE    500     /* ms */
+#define BLK_WRITES_STARVED  2
+
+#define BLK_READ    0
+#define BLK_WRITE   1
+
+/*
+ * Block device numbers.  The SD card is SDDEV and its MBR partitions
+ * are SDDEV+1 to SDDEV+4; the file system lives on partition 2.
+ */
+#define NBLKDEV     10
+#define SDDEV       0
+#define RAMDEV      8
+
+/* Block request layer statistics, per disk. */
+struct blkstat {
+    uint64_t nreq[2];       /* Requests queued, by direction */
+    uint64_t ndispatch[2];  /* Transfers dispatched, by direction */
+    uint64_t nexpire;       /* Dispatches forced by a deadline */
+    uint64_t depth_sum;     /* Queue depth summed over every enqueue */
+    uint64_t depth_max;
+};
+
+struct blkq {
+    struct buf* head;       /* Sorted by sector */
+    struct buf* tail;
+    struct buf* fifo;       /* Oldest request */
+    struct buf* fifo_tail;
+    struct buf* next;       /* Where the elevator resumes */
+    uint32_t pos;           /* Sector following the last dispatched run */
+    int n;
+};
+
+struct blkdev;
+
+/* Driver entry points. */
+struct blkops {
+    /* Start dispatching queued requests, unless already busy. */
+    void (*kick)(struct blkdev* d);
+};
+
+/*
+ * A block device is either a whole disk, which owns the request queue
+ * and the driver, or a partition, which maps its blocks onto a range
+ * of its disk and shares the disk's queue.
+ */
+struct blkdev {
+    char name[8];
+    int dev;
+    struct blkdev* disk;    /* Whole disk holding this device, or itself */
+    uint32_t start;         /* First sector on the disk */
+    uint32_t size;          /* In blocks */
+
+    /* Whole disks only. */
+    const struct blkops* ops;
+    void* priv;             /* Driver private data */
+    int maxrun;             /* Max blocks the driver takes at once */
+    struct spinlock lock;   /* Protects the queue and stats */
+    struct blkq q[2];
+    int starved;            /* Read batches dispatched while writes waited */
+    struct blkstat st;
+    struct blklat lat;
+};
+
+extern struct blkdev blkdev[NBLKDEV];
+
+/* Sector of the disk that b maps to. */
+static inline uint32_t
+blk_sector(struct buf* b)
+{
+    return blkdev[b->dev].start + b->blockno;
+}
+
+void blk_init();
+struct blkdev* blk_register(int dev, const char* name, const struct blkops* ops,
+    void* priv, uint32_t size, int maxrun);
+void blk_add_partitions(struct blkdev* disk, uint8_t* mbr);
+void blkrw(struct buf* b);
+void blkrwv(struct buf** bv, int n);
+void blk_submit(struct buf** bv, int n);
+void blk_wait(struct buf* b);
+struct buf* blk_dispatch(struct blkdev* d);
+void blk_done(struct buf* b);
+void blkstat(int dev, struct blkstat* st);
+
+#endif
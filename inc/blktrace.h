@@ -0,0 +1,55 @@
+/*
+ * Block I/O tracing.
+ * Both the kernel and user programs use this header file.
+ *
+ * The kernel keeps latency histograms per disk and, while tracing is
+ * on, records an event when a request is queued, when a run of
+ * requests is dispatched to the driver and when each request completes.
+ * They are read through device BLKTRACE_MAJOR: minor BLKTRACE_EVENTS
+ * returns the events recorded since the last read, minor BLKTRACE_LAT
+ * one struct blklat per disk.  Tracing is off at boot; writing "1" to
+ * minor BLKTRACE_EVENTS turns it on and "0" off again.
+ */
+#ifndef INC_BLKTRACE_H
+#define INC_BLKTRACE_H
+
+#include <stdint.h>
+
+#define BLKTRACE_MAJOR      2
+#define BLKTRACE_EVENTS     0
+#define BLKTRACE_LAT        1
+
+#define BLKTRACE_NEVENT     4096    /* Events kept in the ring */
+
+/* Actions */
+#define BT_QUEUE            'Q'
+#define BT_DISPATCH         'D'
+#define BT_COMPLETE         'C'
+
+struct blktrace_event {
+    uint64_t ts;            /* Timer ticks */
+    uint32_t sector;        /* First sector on the disk */
+    uint16_t nblk;
+    uint8_t dev;            /* Disk */
+    uint8_t action;
+    uint8_t write;
+    uint8_t pad[7];
+};
+
+/* Bucket i counts latencies of [2^i, 2^(i+1)) microseconds, bucket 0 also less. */
+#define BLKLAT_NBUCKET      24
+
+struct blklat {
+    char name[8];
+    uint32_t dev;
+    uint32_t ticks_per_us;
+    uint64_t n;                         /* Requests completed */
+    uint64_t lost;                      /* Events overwritten before read */
+    uint64_t sum_queue;                 /* Microseconds, queued to dispatched */
+    uint64_t sum_device;                /* ... dispatched to completed */
+    uint64_t queue[BLKLAT_NBUCKET];
+    uint64_t device[BLKLAT_NBUCKET];
+    uint64_t total[BLKLAT_NBUCKET];     /* Queued to completed */
+};
+
+#endif
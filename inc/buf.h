@@ -2,32 +2,94 @@
 #define INC_BUF_H
 
 #include <stdint.h>
+#include "arm.h"
 #include "sleeplock.h"
 #include "fs.h"
 
 #define B_VALID 0x2     /* Buffer has been read from disk. */
 #define B_DIRTY 0x4     /* Buffer needs to be written to disk. */
 #define B_BUSY  0x1
+#define B_ASYNC 0x8     /* Nobody waits; release the buffer on completion. */
+#define B_RA    0x10    /* Read ahead and not used since. */
+#define B_DELWRI 0x20   /* Newer than disk, left to the flusher. */
 
+/*
+ * The cache is sized at boot to roughly 1/BCACHE_MEMFRAC of free memory,
+ * clamped to [NBUF, NBUF_MAX], and hashed into about nbuf/BCACHE_CHAIN buckets.
+ */
+#define NBUF_MAX        16384
+#define BCACHE_MEMFRAC  64
+#define BCACHE_CHAIN    4
 
+/*
+ * Delayed write-back. The flusher thread starts once more than
+ * WB_BG_RATIO percent of the cache is waiting to be written back,
+ * bdwrite() blocks above WB_DIRTY_RATIO percent, and everything is
+ * written back at least every WB_INTERVAL clock ticks.
+ */
+#define WB_BG_RATIO     10
+#define WB_DIRTY_RATIO  40
+#define WB_INTERVAL     5
+#define WB_BATCH        64  /* Buffers written back per batch */
+
+/*
+ * data comes first and is cache line aligned, since the SD driver
+ * moves it by DMA and cleans/invalidates whole lines around it.
+ */
 struct buf {
+    uint8_t data[BSIZE] __attribute__((aligned(CACHE_LINE)));
     int flags;
     uint32_t dev;
     uint32_t blockno;
     uint32_t refcnt;
-    uint8_t data[BSIZE];
     struct sleeplock lock;
 
     /* TODO: Your code here. */
-    struct buf* qnext;
+    struct buf* qnext;  /* Next buf of the run handed to the driver. */
+
+    struct buf* sprev;  /* Block request queue, sorted by blockno. */
+    struct buf* snext;
+    struct buf* fprev;  /* Block request queue, in arrival order. */
+    struct buf* fnext;
+    uint64_t expire;    /* Dispatch deadline, in timer ticks. */
+    uint64_t qtime;     /* Queued at, in timer ticks. */
+    uint64_t dtime;     /* Dispatched at, in timer ticks. */
 
-    struct buf* prev;
+    struct buf* prev;   /* LRU list of the hash bucket, through prev/next. */
     struct buf* next;
 };
 
+/* Buffer cache statistics, summed over all buckets. */
+struct bstat {
+    uint64_t nbuf;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t evict;
+    uint64_t ra;        /* Blocks read ahead */
+    uint64_t rahit;     /* ... later found by bread */
+    uint64_t rawaste;   /* ... evicted before being used */
+    uint64_t dirty;     /* Buffers waiting for the flusher now */
+    uint64_t wsync;     /* Writes waited for inline */
+    uint64_t wasync;    /* Writes started by bwrite_start */
+    uint64_t wback;     /* Buffers written back by the flusher */
+    uint64_t wbatch;    /* ... in that many batches */
+    uint64_t throttle;  /* Times bdwrite blocked for the flusher */
+};
+
 void        binit();
+void        bforget(struct buf* b);
 void        bwrite(struct buf* b);
+void        bwrite_start(struct buf* b);
+void        bwrite_startv(struct buf** bv, int n);
+void        bwait(struct buf* b);
+void        bawrite(struct buf* b);
+void        bdwrite(struct buf* b);
+void        bflush_tick();
 void        brelse(struct buf* b);
 struct buf* bread(uint32_t dev, uint32_t blockno);
+struct buf* bgetblk(uint32_t dev, uint32_t blockno);
+void        breadahead(uint32_t dev, uint32_t* blockno, int n);
+void        brelse_async(struct buf* b);
+void        bstat(struct bstat* st);
 
 #endif
@@ -8,6 +8,24 @@
 
 #define NFILE 100  // Open files per system
 
+/* Sequential readahead window, in blocks. */
+#define RA_MIN  4
+#define RA_MAX  32
+
+/* Readahead state of one stream of reads, such as an open file. */
+struct ra_state {
+    size_t off;         // Offset expected for a sequential read
+    uint32_t issued;    // First block not read ahead yet
+    uint32_t win;       // Current window, 0 if not sequential
+};
+
+#define NIOV 1024  // Max buffers per readv/writev
+
+struct iovec {
+    void* iov_base;    /* Starting address. */
+    size_t iov_len;     /* Number of bytes to transfer. */
+};
+
 struct file {
     enum { FD_NONE, FD_PIPE, FD_INODE } type;
     int ref;
@@ -16,23 +34,58 @@ struct file {
     struct pipe* pipe;
     struct inode* ip;
     size_t off;
+    struct ra_state ra;
 };
 
 
+#define NMOUNT 2   // Mounted file systems
+
+/* The allocator's summary of one bitmap block, see fs.c. */
+struct bmsum {
+    uint16_t nfree;         // Free blocks this bitmap block maps
+    uint16_t first;         // No bit below this one is free
+};
+
+/*
+ * A mounted file system: its superblock and the layout derived from
+ * it, read once by iinit(), and the allocator's state and counters.
+ */
+struct mount {
+    uint32_t dev;
+    int valid;
+    struct superblock sb;
+    uint32_t nbmap;           // Number of bitmap blocks
+    uint32_t datastart;       // First block after the bitmap
+
+    struct spinlock lock;     // Protects everything below here
+    uint32_t nfree;           // Free blocks
+    uint32_t nifree;          // Free inodes
+    struct bmsum* sum;        // Summary of each bitmap block
+    uint32_t rotor;           // Goal for block allocations without one
+    uint64_t* imap;           // Inode bitmap, a set bit is in use
+    uint32_t ifirst;          // No inode below this one is free
+};
+
 /* In-memory copy of an inode. */
 struct inode {
     uint32_t dev;             // Device number
     uint32_t inum;            // Inode number
     int ref;                  // Reference count
+    struct inode* hnext;      // Hash chain
+    struct inode* next;       // LRU list of unreferenced inodes
+    struct inode* prev;
     struct sleeplock lock;    // Protects everything below here
     int valid;                // Inode has been read from disk?
+    uint32_t goal;            // Last block allocated, to place the next after
+    struct radix_node* pages; // Page cache of a regular file, see pcache.c
+    int pheight;              // ... and the height of its tree
 
     uint16_t type;            // Copy of disk inode
     uint16_t major;
     uint16_t minor;
     uint16_t nlink;
     uint32_t size;
-    uint32_t addrs[NDIRECT + 1];
+    uint32_t addrs[NDIRECT + NLEVEL];
 };
 
 /*
@@ -46,12 +99,44 @@ struct devsw {
 
 extern struct devsw devsw[];
 
+/* Directory entry as returned by getdents64, in the Linux layout. */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;            // Offset of the next entry
+    uint16_t d_reclen;        // Size of this record, a multiple of 8
+    uint8_t d_type;           // One of DT_*
+    char d_name[];
+};
+
+#define DT_UNKNOWN 0
+#define DT_CHR     2
+#define DT_DIR     4
+#define DT_REG     8
+
+struct dstat {
+    uint64_t hit;
+    uint64_t neghit;    /* Hits on names known to be absent */
+    uint64_t miss;
+};
+
+struct istat {
+    uint64_t ninode;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t evict;     /* Valid unreferenced inodes recycled */
+};
+
 void            readsb(int, struct superblock*);
+struct mount*   getmount(uint32_t);
 int             dirlink(struct inode*, char*, uint32_t);
 struct inode* dirlookup(struct inode*, char*, size_t*);
+ssize_t         dirread(struct inode*, char*, size_t*, size_t);
 struct inode* ialloc(uint32_t, short);
 struct inode* idup(struct inode*);
 void            iinit(int dev);
+void            istat(struct istat*);
+void            dstat(struct dstat*);
+void            dcache_drop(struct inode*);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -62,6 +147,8 @@ struct inode* namei(char*);
 struct inode* nameiparent(char*, char*);
 void            stati(struct inode*, struct stat*);
 ssize_t         readi(struct inode*, char*, size_t, size_t);
+struct page*    ipage(struct inode*, size_t, size_t);
+void            readahead(struct inode*, struct ra_state*, size_t, size_t);
 ssize_t         writei(struct inode*, char*, size_t, size_t);
 
 struct file* filealloc();
@@ -69,13 +156,26 @@ struct file* filedup(struct file* f);
 void            fileclose(struct file* f);
 int             filestat(struct file* f, struct stat* st);
 ssize_t         fileread(struct file* f, char* addr, ssize_t n);
+ssize_t         filereadv(struct file* f, struct iovec* iov, int cnt, size_t* off);
+ssize_t         filereaddir(struct file* f, char* addr, ssize_t n);
 ssize_t         filewrite(struct file* f, char* addr, ssize_t n);
+ssize_t         filewritev(struct file* f, struct iovec* iov, int cnt, size_t* off);
+ssize_t         filesend(struct file* out, struct file* in, size_t* off, size_t n);
 
 int sys_dup();
 ssize_t sys_read();
+ssize_t sys_readv();
+ssize_t sys_pread64();
+ssize_t sys_preadv();
 ssize_t sys_write();
 ssize_t sys_writev();
+ssize_t sys_pwrite64();
+ssize_t sys_pwritev();
+ssize_t sys_getdents64();
+ssize_t sys_sendfile();
 int sys_close();
+int sys_sync();
+int sys_fsync();
 int sys_fstat();
 int sys_fstatat();
 int sys_openat();
@@ -9,16 +9,23 @@
 
  // Kernel only
 #define NDEV            10                  // Maximum major device number
-#define NINODE          50                  // Maximum number of active i-nodes
-#define MAXOPBLOCKS     10                  // Max # of blocks any FS op writes
-#define NBUF            (MAXOPBLOCKS*3)     // Size of disk block cache
+#define NINODE          50                  // Cached i-nodes at boot
+#define NINODE_MAX      1000                // Maximum number of cached i-nodes
+#define MAXOPBLOCKS     16                  // Max # of blocks any FS op writes, see dx_add()
+#define NBUF            (MAXOPBLOCKS*3)     // Minimum size of disk block cache
 
 // mkfs only
 #define FSSIZE          1000                // Size of file system in blocks
 
 // Belows are used by both
-#define LOGSIZE         (MAXOPBLOCKS*3)     // Max data blocks in on-disk log
-#define ROOTDEV         1                   // Device number of file system root disk
+#define LOGSIZE         (MAXOPBLOCKS*3)     // Max data blocks in a log transaction
+#define LOGTXN          (LOGSIZE+1)         // Max log blocks of a transaction, with its descriptor
+#define NLOG            (1+3*LOGTXN)        // Size of the log area, a super block and a circular log
+#ifdef RAMDISK_ROOT
+#define ROOTDEV         8                   // Device number of file system root disk (RAMDEV)
+#else
+#define ROOTDEV         2                   // Device number of file system root disk (SD partition 2)
+#endif
 #define ROOTINO         1                   // Root i-number
 
 #define BSIZE           512                 // Block size
@@ -39,9 +46,14 @@ struct superblock {
   uint32_t bmapstart;    // Block number of first free map block
 };
 
-#define NDIRECT 12
+/*
+ * An inode lists NDIRECT data blocks, then one single, one double and
+ * one triple indirect block, in addrs[NDIRECT + NLEVEL].
+ */
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint32_t))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NLEVEL 3
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT + NINDIRECT * NINDIRECT * NINDIRECT)
 
 /* On-disk inode structure. */
 struct dinode {
@@ -50,9 +62,16 @@ struct dinode {
   uint16_t minor;               // Minor device number (T_DEV only)
   uint16_t nlink;               // Number of links to inode in file system
   uint32_t size;                // Size of file (bytes)
-  uint32_t addrs[NDIRECT + 1];    // Data block addresses
+  uint32_t addrs[NDIRECT + NLEVEL];   // Data block addresses, or inline data
 };
 
+/*
+ * A regular file of at most NINLINE bytes keeps its data in addrs[]
+ * instead of in a block.  It moves to blocks when it grows past that.
+ */
+#define NINLINE (sizeof(uint32_t) * (NDIRECT + NLEVEL))
+#define INLINE_DATA(type, size) ((type) == T_FILE && (size) <= NINLINE)
+
 /* Inodes per block. */
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -73,6 +92,49 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+/* Directory entries per block. */
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+/*
+ * A directory that outgrows one block is indexed as a hash tree.
+ * Block 0 is the root index node and the other blocks are index
+ * nodes or leaves, which are plain blocks of dirents.  An index
+ * node is a block of dirent-sized slots whose inum is 0, so that
+ * readers of dirents skip it: a header, then entries sorted by the
+ * least name hash in the block they point to.
+ */
+#define DX_MAGIC      0x5844        // "DX"
+#define DX_NENTRY     (DPB - 1)     // Entries per index node
+#define DX_MAXLEVEL   2             // Index levels, counting the root
+
+struct dxhdr {
+  uint16_t inum;                // Always 0
+  uint16_t magic;               // DX_MAGIC
+  uint16_t level;               // Index levels below this node
+  uint16_t count;               // Entries in use
+  uint32_t pad[2];
+};
+
+struct dxentry {
+  uint16_t inum;                // Always 0
+  uint16_t pad;
+  uint32_t hash;                // Least hash of the names under block
+  uint32_t block;               // Directory block number
+  uint32_t pad2;
+};
+
+/* Hash of a directory entry name (FNV-1a). */
+static inline uint32_t
+dx_hash(const char* name)
+{
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+  return h;
+}
+
 #define T_DIR  1   // Directory
 #define T_FILE 2   // File
 #define T_DEV  3   // Device
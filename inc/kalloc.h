@@ -1,10 +1,13 @@
 #ifndef KERN_KALLOC_H
 #define KERN_KALLOC_H
 
+#include <stddef.h>
+
 void alloc_init();
 char *kalloc();
 void kfree(char*);
 void free_range(void *, void *);
 void check_free_list();
+size_t free_page_count();
 
 #endif /* !KERN_KALLOC_H */
@@ -1,11 +1,75 @@
 #ifndef INC_LOG_H
 #define INC_LOG_H
 
+#include <stdint.h>
+#include "fs.h"
+
+/*
+ * Group commit: an open transaction is committed once it is this
+ * many clock ticks old or holds this many blocks, whichever is first.
+ */
+#define LOG_COMMIT_TICKS    1
+#define LOG_COMMIT_BLOCKS   (LOGSIZE - 2 * MAXOPBLOCKS)
+
+/* Committed blocks are installed at least this often, in clock ticks. */
+#define LOG_CHECKPOINT_TICKS    5
+
+/*
+ * Journaling modes.  LOG_JOURNAL logs every block.  LOG_ORDERED logs
+ * only metadata; file data is written in place, up to LOG_MAXDATA
+ * blocks per transaction, and forced to disk before the transaction
+ * commits.  The mode is kept in the log super block, where mkfs puts
+ * it, and initlog() mounts the log in it.
+ */
+#define LOG_JOURNAL         0
+#define LOG_ORDERED         1
+
+/* The log super block, the first block of the log area. */
+#define LOG_SUPER   0x4c4f4753  // "LOGS"
+
+struct logsuper {
+    uint32_t magic;
+    uint32_t tail;      // Offset of the oldest transaction to replay.
+    uint64_t tid;       // Its tid.
+    uint32_t mode;      // LOG_JOURNAL or LOG_ORDERED.
+};
+
+#define LOG_MAXDATA         256
+#define LOG_ORDERED_MAXWRITE    (64 * BSIZE)    /* filewrite() chunk */
+
+/*
+ * filewrite() chunk when data is logged too: what is left of an
+ * operation after the inode, two bitmap blocks, the indirect blocks
+ * along two paths, and one block for an unaligned start.
+ */
+#define LOG_JOURNAL_MAXWRITE    ((MAXOPBLOCKS - 1 - 2 - (2 * NLEVEL - 1) - 1) * BSIZE)
+
+struct logstat {
+    uint64_t nop;       /* Operations begun */
+    uint64_t ncommit;   /* Transactions committed */
+    uint64_t nblock;    /* Blocks committed */
+    uint64_t nsync;     /* log_sync() calls */
+    uint64_t ncheckpoint;   /* Checkpoints */
+    uint64_t nckblock;  /* ... blocks installed from the cache */
+    uint64_t nckcopy;   /* ... from their log copy */
+    uint64_t nckskip;   /* ... left to a later transaction */
+    uint64_t nreplay;   /* Transactions replayed at recovery */
+    uint64_t ndata;     /* Data blocks written in place before commit */
+};
+
 struct buf;
 
 void initlog(int dev);
 void log_write(struct buf *);
+void log_write_data(struct buf *);
+void log_freed(uint32_t b);
+int  log_ordered();
+int  log_busy(uint32_t b);
+int  log_pinned(uint32_t dev, uint32_t b);
 void begin_op();
 void end_op();
+void log_sync();
+void log_tick();
+void logstat(struct logstat* st);
 
 #endif
@@ -0,0 +1,59 @@
+#ifndef INC_PCACHE_H
+#define INC_PCACHE_H
+
+#include <stdint.h>
+#include "mmu.h"
+#include "fs.h"
+
+#define BPP (PGSIZE / BSIZE)    /* Blocks per page */
+
+/*
+ * The cache takes about 1/PCACHE_MEMFRAC of the free memory at boot,
+ * and never less than NPAGE pages.
+ */
+#define NPAGE           64
+#define PCACHE_MEMFRAC  16
+
+/* Radix tree fan-out: each level resolves RADIX_SHIFT bits of the index. */
+#define RADIX_SHIFT     6
+#define RADIX_SLOTS     (1 << RADIX_SHIFT)
+
+/*
+ * One page of file data, index pages into its owner's file.
+ * valid and dirty hold a bit per block of the page and are
+ * protected by the owner's lock; the rest by pcache.lock.
+ */
+struct page {
+    char* data;
+    struct inode* ip;   /* Owner, 0 if free */
+    uint32_t index;
+    uint8_t valid;      /* Blocks read in or written */
+    uint8_t dirty;      /* Blocks written and not written back yet */
+    int ref;
+    struct page* prev;  /* LRU list, through prev/next. */
+    struct page* next;
+};
+
+struct radix_node {
+    int count;          /* Slots in use */
+    void* slot[RADIX_SLOTS];
+};
+
+/* Page cache statistics. */
+struct pstat {
+    uint64_t npage;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t evict;     /* Pages of another file recycled */
+};
+
+struct inode;
+
+void         pcache_init();
+struct page* pget(struct inode* ip, uint32_t index);
+int          pvalid(struct inode* ip, uint32_t index);
+void         pput(struct page* pg);
+void         pdrop(struct inode* ip);
+void         pstat(struct pstat* st);
+
+#endif
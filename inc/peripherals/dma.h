@@ -0,0 +1,56 @@
+/* See BCM2837 ARM Peripherals, chapter 4 DMA Controller. */
+#ifndef INC_PERIPHERALS_DMA_H
+#define INC_PERIPHERALS_DMA_H
+
+#include <stdint.h>
+#include "peripherals/base.h"
+
+#define DMA_BASE                (MMIO_BASE + 0x7000)
+#define DMA_CS(ch)              ((volatile uint32_t*)(DMA_BASE + 0x100*(ch) + 0x00))
+#define DMA_CONBLK_AD(ch)       ((volatile uint32_t*)(DMA_BASE + 0x100*(ch) + 0x04))
+#define DMA_DEBUG(ch)           ((volatile uint32_t*)(DMA_BASE + 0x100*(ch) + 0x20))
+#define DMA_ENABLE              ((volatile uint32_t*)(DMA_BASE + 0xFF0))
+
+/* CS register */
+#define DMA_CS_ACTIVE           (1 << 0)
+#define DMA_CS_END              (1 << 1)
+#define DMA_CS_INT              (1 << 2)
+#define DMA_CS_ERROR            (1 << 8)
+#define DMA_CS_PRIORITY(x)      ((x) << 16)
+#define DMA_CS_PANIC_PRIORITY(x) ((x) << 20)
+#define DMA_CS_WAIT_WRITES      (1 << 28)
+#define DMA_CS_ABORT            (1 << 30)
+#define DMA_CS_RESET            (1 << 31)
+
+/* Transfer information of a control block */
+#define DMA_TI_INTEN            (1 << 0)
+#define DMA_TI_WAIT_RESP        (1 << 3)
+#define DMA_TI_DEST_INC         (1 << 4)
+#define DMA_TI_DEST_DREQ        (1 << 6)
+#define DMA_TI_SRC_INC          (1 << 8)
+#define DMA_TI_SRC_DREQ         (1 << 10)
+#define DMA_TI_PERMAP(x)        ((x) << 16)
+#define DMA_TI_NO_WIDE_BURSTS   (1 << 26)
+
+/* Peripheral DREQ numbers for PERMAP */
+#define DMA_DREQ_EMMC           11
+
+/* Control blocks are read by the DMA engine and must be 32-byte aligned. */
+struct dma_cb {
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t reserved[2];
+} __attribute__((aligned(32)));
+
+/*
+ * Addresses as seen by the DMA engine: peripherals live at 0x7E000000,
+ * and SDRAM is reached through the uncached 0xC0000000 alias.
+ */
+#define BUS_PERIPH(a)           ((uint32_t)((uint64_t)(a) - MMIO_BASE + 0x7E000000))
+#define BUS_ADDR(p)             ((uint32_t)(V2P(p) | 0xC0000000))
+
+#endif
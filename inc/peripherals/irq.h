@@ -15,6 +15,7 @@
 #define DISABLE_IRQS_2          (MMIO_BASE + 0xB220)
 #define DISABLE_BASIC_IRQS      (MMIO_BASE + 0xB224)
 
+#define DMA_INT(ch)             (1 << (16 + (ch)))   /* Channels 0-12 */
 #define AUX_INT                 (1 << 29)
 #define VC_ARASANSDIO_INT       (1 << 30)
 
@@ -74,6 +74,7 @@ thisproc()
 
 void proc_init();
 void user_init();
+void kthread_create(void (*fn)(), char* name);
 void scheduler();
 
 void yield();
@@ -0,0 +1,11 @@
+#ifndef INC_RAMDISK_H
+#define INC_RAMDISK_H
+
+#include <stdint.h>
+
+#define RAMDISK_MAXRUN  64  /* Blocks copied per dispatch */
+
+void ramdisk_init(uint32_t nblocks);
+void ramdisk_load(int src);
+
+#endif
@@ -19,9 +19,11 @@
 #define SD_READ_BLOCKS       0
 #define SD_WRITE_BLOCKS      1
 
+#define SD_MAXBLKS           32  /* Max blocks merged into one transfer */
+#define SD_DMA_CHAN          5   /* DMA channel moving EMMC data */
+
 void sd_init();
 void sd_intr();
 void sd_test();
-void sdrw(struct buf*);
 
 #endif
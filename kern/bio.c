@@ -1,6 +1,6 @@
 /* Buffer cache.
  *
- * The buffer cache is a linked list of buf structures holding
+ * The buffer cache is a hash table of buf structures holding
  * cached copies of disk block contents.  Caching disk blocks
  * in memory reduces the number of disk reads and also provides
  * a synchronization point for disk blocks used by multiple processes.
@@ -13,58 +13,204 @@
  * * Only one process at a time can use a buffer,
  *     so do not keep them longer than necessary.
  *
- * The implementation uses two state flags internally:
+ * The implementation uses these state flags internally:
  * * B_VALID: the buffer data has been read from the disk.
  * * B_DIRTY: the buffer data has been modified
  *     and needs to be written to disk.
+ * * B_DELWRI: the buffer data is newer than the disk and will be
+ *     written back by the flusher thread (see bdwrite).
+ *
+ * Buffers are hashed by (dev, blockno) into buckets, each with
+ * its own spinlock and its own LRU list, so lookups of different
+ * blocks rarely contend.  A miss recycles the least recently used
+ * idle buffer of its own bucket; only when the bucket has none does
+ * it take bcache.lock and steal one from another bucket.  Lock order
+ * is bcache.lock, then the home bucket, then the victim bucket.
+ *
+ * The number of buffers is chosen at boot from the free memory
+ * left after the page allocator is initialized.
+ *
+ * breadahead starts reads without waiting for them.  Such a buffer
+ * stays locked while the read is in flight and is released by the
+ * completion, so a bread of it simply waits on the buffer lock.
+ *
+ * bwrite_start/bwait split bwrite in two, so that a batch of writes
+ * can be queued together and reach the device sorted and merged.
+ * bdwrite leaves the write to the flusher thread, which writes back
+ * idle B_DELWRI buffers in batches when too much of the cache is
+ * dirty, or every WB_INTERVAL clock ticks.
  */
 
+#include "types.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "buf.h"
 #include "console.h"
+#include "kalloc.h"
+#include "proc.h"
+#include "blk.h"
 #include "sd.h"
 #include "fs.h"
+#include "log.h"
 
-struct {
+struct bucket {
     struct spinlock lock;
-    struct buf buf[NBUF];
+    struct buf* mru;    /* Circular LRU list; mru->prev is least recent. */
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t evict;
+    uint64_t ra;
+    uint64_t rahit;
+    uint64_t rawaste;
+};
 
-    // Linked list of all buffers, through prev/next.
-    // head.next is most recently used.
-    struct buf head;
+struct {
+    struct spinlock lock;   /* Serializes stealing between buckets. */
+    struct bucket bucket[NBUF_MAX / BCACHE_CHAIN];
+    int nbucket;            /* Buckets in use, always a power of 2. */
+    int nbuf;
 } bcache;
 
+struct {
+    struct spinlock lock;
+    int ndirty;             /* B_DELWRI buffers */
+    int bg;                 /* Start the flusher above this many */
+    int hard;               /* Throttle bdwrite above this many */
+    int kick;               /* Periodic write-back is due */
+    int ticks;
+    int scan;               /* Next bucket for the flusher to scan */
+    uint64_t wsync, wasync, wback, wbatch, throttle;
+} wb;
+
+static void bflusher();
+
+static struct bucket*
+bhash(uint32_t dev, uint32_t blockno)
+{
+    uint32_t h = (blockno ^ (dev << 24)) * 2654435761u;
+    return &bcache.bucket[(h >> 8) & (bcache.nbucket - 1)];
+}
+
+/* Insert b at the most recently used end of bk. Caller holds bk->lock. */
+static void
+bucket_insert(struct bucket* bk, struct buf* b)
+{
+    if (bk->mru == 0) {
+        b->next = b->prev = b;
+    } else {
+        b->next = bk->mru;
+        b->prev = bk->mru->prev;
+        bk->mru->prev->next = b;
+        bk->mru->prev = b;
+    }
+    bk->mru = b;
+}
+
+/* Unlink b from bk. Caller holds bk->lock. */
+static void
+bucket_remove(struct bucket* bk, struct buf* b)
+{
+    if (b->next == b) {
+        bk->mru = 0;
+    } else {
+        b->next->prev = b->prev;
+        b->prev->next = b->next;
+        if (bk->mru == b)
+            bk->mru = b->next;
+    }
+    b->next = b->prev = 0;
+}
+
+static struct buf*
+bucket_lookup(struct bucket* bk, uint32_t dev, uint32_t blockno)
+{
+    struct buf* b = bk->mru;
+
+    if (b == 0)
+        return 0;
+    do {
+        if (b->dev == dev && b->blockno == blockno)
+            return b;
+        b = b->next;
+    } while (b != bk->mru);
+    return 0;
+}
+
+/* Find the least recently used buffer of bk that may be recycled. */
+static struct buf*
+bucket_victim(struct bucket* bk)
+{
+    struct buf* b;
+
+    if (bk->mru == 0)
+        return 0;
+    b = bk->mru;
+    do {
+        b = b->prev;
+        if (b->refcnt == 0 && (b->flags & (B_DIRTY | B_DELWRI)) == 0)
+            return b;
+    } while (b != bk->mru);
+    return 0;
+}
+
+/* Give the recycled buffer b a new identity. Caller holds its bucket lock. */
+static void
+brecycle(struct bucket* bk, struct buf* b, uint32_t dev, uint32_t blockno)
+{
+    if (b->flags & B_VALID)
+        bk->evict++;
+    if (b->flags & B_RA)
+        bk->rawaste++;
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    b->refcnt = 1;
+}
+
 /* Initialize the cache list and locks. */
 void
 binit()
 {
     /* TODO: Your code here. */
     struct buf* b;
+    char* p;
+    int i, nbuf, perpage;
 
-    initlock(&bcache.lock, "bcache");
-
-    bcache.head.prev = &bcache.head;
-    bcache.head.next = &bcache.head;
-
-    //           b
-    //           |
-    //bcache.head->bcache.head.next
-    //insert b into the list
-    for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
+    nbuf = free_page_count() / BCACHE_MEMFRAC * PGSIZE / sizeof(struct buf);
+    nbuf = MIN(MAX(nbuf, NBUF), NBUF_MAX);
 
-        b->dev = -1;
-        b->next = bcache.head.next;
-        b->prev = &bcache.head;
-        bcache.head.next->prev = b;
-        bcache.head.next = b;
-
-        initsleeplock(&b->lock, "buffer");
+    for (bcache.nbucket = 1; bcache.nbucket * BCACHE_CHAIN < nbuf; )
+        bcache.nbucket <<= 1;
 
+    initlock(&bcache.lock, "bcache");
+    for (i = 0; i < bcache.nbucket; i++)
+        initlock(&bcache.bucket[i].lock, "bcache.bucket");
 
+    /* Carve the buffers out of whole pages and spread them over the buckets. */
+    perpage = PGSIZE / sizeof(struct buf);
+    for (bcache.nbuf = 0; bcache.nbuf < nbuf; ) {
+        if ((p = kalloc()) == 0)
+            break;
+        for (b = (struct buf*)p; b < (struct buf*)p + perpage && bcache.nbuf < nbuf; b++) {
+            b->dev = -1;
+            b->blockno = 0;
+            b->flags = 0;
+            b->refcnt = 0;
+            b->qnext = 0;
+            initsleeplock(&b->lock, "buffer");
+            bucket_insert(&bcache.bucket[bcache.nbuf++ & (bcache.nbucket - 1)], b);
+        }
     }
+    if (bcache.nbuf < NBUF)
+        panic("binit: only %d buffers", bcache.nbuf);
 
+    initlock(&wb.lock, "bflush");
+    wb.bg = bcache.nbuf * WB_BG_RATIO / 100;
+    wb.hard = bcache.nbuf * WB_DIRTY_RATIO / 100;
+    kthread_create(bflusher, "bflush");
 
+    cprintf("binit: %d buffers in %d buckets\n", bcache.nbuf, bcache.nbucket);
 }
 
 /*
@@ -76,39 +222,60 @@ static struct buf*
 bget(uint32_t dev, uint32_t blockno)
 {
     /* TODO: Your code here. */
+    struct bucket* bk = bhash(dev, blockno), * vk;
     struct buf* b;
-    acquire(&bcache.lock);
+    int i;
 
-    //from  https://github.com/sudharson14/xv6-OS-for-arm-v8/blob/master/xv6-armv8/bio.c
-loop:
-    for (b = bcache.head.next; b != &bcache.head; b = b->next) {
-
-        if (b->dev == dev && b->blockno == blockno) {
-            if (!holdingsleep(&b->lock)) {
-                b->refcnt++;
-                release(&bcache.lock);
-                acquiresleep(&b->lock);
-                return b;
-            }
-            sleep(b, &bcache.lock);
-            goto loop;
-        }
+    acquire(&bk->lock);
+    if ((b = bucket_lookup(bk, dev, blockno)) != 0) {
+        b->refcnt++;
+        bk->hit++;
+        release(&bk->lock);
+        acquiresleep(&b->lock);
+        return b;
     }
+    bk->miss++;
+    if ((b = bucket_victim(bk)) != 0) {
+        brecycle(bk, b, dev, blockno);
+        release(&bk->lock);
+        acquiresleep(&b->lock);
+        return b;
+    }
+    release(&bk->lock);
 
-    for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-        if ((!holdingsleep(&b->lock)) && (b->flags & B_DIRTY) == 0) {
-            b->dev = dev;
-            b->blockno = blockno;
-            // b->flags &= ~B_VALID;//set valid bit to 0
-            b->flags = 0;
-            b->refcnt = 1;
-            release(&bcache.lock);
-            acquiresleep(&b->lock);
-            return b;
+    /*
+     * No idle buffer in this bucket, steal one from another.
+     * The block may have been cached by someone else meanwhile.
+     */
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+    if ((b = bucket_lookup(bk, dev, blockno)) != 0) {
+        b->refcnt++;
+        goto found;
+    }
+    if ((b = bucket_victim(bk)) != 0) {
+        brecycle(bk, b, dev, blockno);
+        goto found;
+    }
+    for (i = 1; i < bcache.nbucket; i++) {
+        vk = &bcache.bucket[((bk - bcache.bucket) + i) & (bcache.nbucket - 1)];
+        acquire(&vk->lock);
+        if ((b = bucket_victim(vk)) != 0) {
+            bucket_remove(vk, b);
+            brecycle(vk, b, dev, blockno);
+            release(&vk->lock);
+            bucket_insert(bk, b);
+            goto found;
         }
+        release(&vk->lock);
     }
-
     panic("bget: no buffers");
+
+found:
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
 }
 
 /* Return a locked buf with the contents of the indicated block. */
@@ -118,14 +285,103 @@ struct buf*
     /* TODO: Your code here. */
     struct buf* b;
 
-    b = bget(dev, blockno + 0x20800);
+    b = bget(dev, blockno);
 
     if (!(b->flags & B_VALID)) {
-        sdrw(b);
+        blkrw(b);
+    }
+    if (b->flags & B_RA) {
+        struct bucket* bk = bhash(b->dev, b->blockno);
+        b->flags &= ~B_RA;
+        acquire(&bk->lock);
+        bk->rahit++;
+        release(&bk->lock);
     }
     return b;
 }
 
+/*
+ * Return a locked buf for a block the caller overwrites entirely,
+ * without reading its old contents.
+ */
+struct buf*
+bgetblk(uint32_t dev, uint32_t blockno)
+{
+    return bget(dev, blockno);
+}
+
+/*
+ * Start reading the n blocks that are not cached yet,
+ * without waiting for them.
+ */
+void
+breadahead(uint32_t dev, uint32_t* blockno, int n)
+{
+    struct buf* bv[SD_MAXBLKS];
+    struct bucket* bk;
+    struct buf* b;
+    int i, k, cached;
+
+    for (i = k = 0; i < n; i++) {
+        bk = bhash(dev, blockno[i]);
+        acquire(&bk->lock);
+        cached = bucket_lookup(bk, dev, blockno[i]) != 0;
+        release(&bk->lock);
+        if (cached)
+            continue;
+
+        b = bget(dev, blockno[i]);
+        if (b->flags & B_VALID) {
+            brelse(b);
+            continue;
+        }
+        b->flags |= B_ASYNC | B_RA;
+        bv[k++] = b;
+        acquire(&bk->lock);
+        bk->ra++;
+        release(&bk->lock);
+        if (k == SD_MAXBLKS) {
+            blk_submit(bv, k);
+            k = 0;
+        }
+    }
+    if (k)
+        blk_submit(bv, k);
+}
+
+/*
+ * b is about to be written, so it no longer waits for the flusher.
+ * Counts the write in *cnt if given.
+ */
+static void
+bclean(struct buf* b, uint64_t* cnt)
+{
+    acquire(&wb.lock);
+    if (b->flags & B_DELWRI) {
+        b->flags &= ~B_DELWRI;
+        wb.ndirty--;
+        wakeup(&wb.ndirty);
+    }
+    if (cnt)
+        (*cnt)++;
+    release(&wb.lock);
+}
+
+/*
+ * b is about to be logged as metadata, which must not reach its home
+ * location before the transaction commits.  Take it off the flusher's
+ * hands, in case it was file data still waiting to be written back.
+ * Must be locked.
+ */
+void
+bforget(struct buf* b)
+{
+    if (!holdingsleep(&b->lock))
+        panic("bforget");
+
+    bclean(b, 0);
+}
+
 /* Write b's contents to disk. Must be locked. */
 void
 bwrite(struct buf* b)
@@ -135,41 +391,235 @@ bwrite(struct buf* b)
     if (!holdingsleep(&b->lock))
         panic("bwrite");
 
+    bclean(b, &wb.wsync);
     b->flags |= B_DIRTY;
-    sdrw(b);
+    blkrw(b);
+}
+
+/*
+ * Start writing b's contents to disk and return at once.
+ * b must be locked, and stays locked until bwait(b) has returned.
+ */
+void
+bwrite_start(struct buf* b)
+{
+    bwrite_startv(&b, 1);
+}
+
+/*
+ * Start writing the n bufs in bv together, so that consecutive
+ * blocks go to the disk as one transfer.  Same rules as bwrite_start.
+ */
+void
+bwrite_startv(struct buf** bv, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!holdingsleep(&bv[i]->lock))
+            panic("bwrite_start");
+        bclean(bv[i], &wb.wasync);
+        bv[i]->flags |= B_DIRTY;
+    }
+    blk_submit(bv, n);
+}
+
+/* Wait for the write started by bwrite_start(b). */
+void
+bwait(struct buf* b)
+{
+    if (!holdingsleep(&b->lock))
+        panic("bwait");
+
+    blk_wait(b);
+}
+
+/*
+ * Start writing b's contents to disk and release b when the write
+ * completes.  b must be locked.
+ */
+void
+bawrite(struct buf* b)
+{
+    if (!holdingsleep(&b->lock))
+        panic("bawrite");
+
+    bclean(b, &wb.wasync);
+    b->flags |= B_DIRTY | B_ASYNC;
+    blk_submit(&b, 1);
+}
+
+/*
+ * Mark b's contents to be written to disk later by the flusher,
+ * instead of now. Must be locked. Blocks while too much of the
+ * cache is waiting to be written back.
+ */
+void
+bdwrite(struct buf* b)
+{
+    if (!holdingsleep(&b->lock))
+        panic("bdwrite");
+
+    acquire(&wb.lock);
+    if (!(b->flags & B_DELWRI)) {
+        b->flags |= B_DELWRI;
+        if (++wb.ndirty > wb.bg)
+            wakeup(&wb);
+    }
+    while (wb.ndirty > wb.hard) {
+        wb.throttle++;
+        sleep(&wb.ndirty, &wb.lock);
+    }
+    release(&wb.lock);
+}
+
+/* Called on every clock tick to schedule periodic write-back. */
+void
+bflush_tick()
+{
+    acquire(&wb.lock);
+    if (++wb.ticks % WB_INTERVAL == 0 && wb.ndirty) {
+        wb.kick = 1;
+        wakeup(&wb);
+    }
+    release(&wb.lock);
+}
+
+/*
+ * Collect up to max idle B_DELWRI buffers, locked and sorted by
+ * block number, resuming the scan where the last call stopped.
+ * Buffers the log has pinned are left alone: they may only be
+ * written by the log.
+ */
+static int
+bcollect(struct buf** bv, int max)
+{
+    struct bucket* bk;
+    struct buf* b;
+    int i, j, n, k;
+
+    for (i = n = 0; i < bcache.nbucket && n < max; i++) {
+        bk = &bcache.bucket[wb.scan];
+        wb.scan = (wb.scan + 1) & (bcache.nbucket - 1);
+        acquire(&bk->lock);
+        if ((b = bk->mru) != 0) {
+            do {
+                if ((b->flags & (B_DELWRI | B_DIRTY)) == B_DELWRI && b->refcnt == 0 && n < max) {
+                    b->refcnt++;
+                    bv[n++] = b;
+                }
+                b = b->next;
+            } while (b != bk->mru);
+        }
+        release(&bk->lock);
+    }
+
+    for (i = k = 0; i < n; i++) {
+        b = bv[i];
+        acquiresleep(&b->lock);
+        if ((b->flags & (B_DELWRI | B_DIRTY)) != B_DELWRI || log_pinned(b->dev, b->blockno)) {
+            brelse(b);
+            continue;
+        }
+        for (j = k++; j > 0 && bv[j - 1]->blockno > b->blockno; j--)
+            bv[j] = bv[j - 1];
+        bv[j] = b;
+    }
+    return k;
+}
+
+/* The flusher thread. */
+static void
+bflusher()
+{
+    struct buf* bv[WB_BATCH];
+    int i, n;
+
+    for (;;) {
+        acquire(&wb.lock);
+        while (!wb.kick && wb.ndirty <= wb.bg)
+            sleep(&wb, &wb.lock);
+        wb.kick = 0;
+        release(&wb.lock);
+
+        while ((n = bcollect(bv, WB_BATCH)) > 0) {
+            for (i = 0; i < n; i++) {
+                bclean(bv[i], 0);
+                bv[i]->flags |= B_DIRTY;
+            }
+            blk_submit(bv, n);
+            for (i = 0; i < n; i++) {
+                blk_wait(bv[i]);
+                brelse(bv[i]);
+            }
+            acquire(&wb.lock);
+            wb.wback += n;
+            wb.wbatch++;
+            release(&wb.lock);
+        }
+    }
 }
 
 /*
  * Release a locked buffer.
- * Move to the head of the MRU list.
+ * Move to the head of the MRU list of its bucket.
  */
 void
 brelse(struct buf* b)
 {
     /* TODO: Your code here. */
-    // if ((b->flags & B_BUSY) == 0) {
-    //     panic("brelse");
-    // }
-    acquire(&bcache.lock);
+
     if (!holdingsleep(&b->lock))
         panic("brelse");
-    releasesleep(&b->lock);
+    brelse_async(b);
+}
 
-    if (--b->refcnt == 0) {
-        //delete it from the list
-        b->next->prev = b->prev;
-        b->prev->next = b->next;
+/*
+ * Release a buffer whose lock may be held on behalf of another
+ * process, as for a completed asynchronous request.
+ */
+void
+brelse_async(struct buf* b)
+{
+    struct bucket* bk;
 
-        //insert it into the head of the list
-        b->next = bcache.head.next;
-        b->prev = &bcache.head;
-        bcache.head.next->prev = b;
-        bcache.head.next = b;
-        wakeup(b);
-    }
+    releasesleep(&b->lock);
 
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if (--b->refcnt == 0 && bk->mru != b) {
+        bucket_remove(bk, b);
+        bucket_insert(bk, b);
+    }
+    release(&bk->lock);
+}
 
+/* Collect hit/miss/eviction counters of all buckets. */
+void
+bstat(struct bstat* st)
+{
+    struct bucket* bk;
 
+    st->nbuf = bcache.nbuf;
+    st->hit = st->miss = st->evict = 0;
+    st->ra = st->rahit = st->rawaste = 0;
+    for (bk = bcache.bucket; bk < bcache.bucket + bcache.nbucket; bk++) {
+        acquire(&bk->lock);
+        st->hit += bk->hit;
+        st->miss += bk->miss;
+        st->evict += bk->evict;
+        st->ra += bk->ra;
+        st->rahit += bk->rahit;
+        st->rawaste += bk->rawaste;
+        release(&bk->lock);
+    }
 
-    release(&bcache.lock);
+    acquire(&wb.lock);
+    st->dirty = wb.ndirty;
+    st->wsync = wb.wsync;
+    st->wasync = wb.wasync;
+    st->wback = wb.wback;
+    st->wbatch = wb.wbatch;
+    st->throttle = wb.throttle;
+    release(&wb.lock);
 }
@@ -0,0 +1,462 @@
+/*
+ * Block request layer.
+ *
+ * Sits between the buffer cache and the block device drivers.  bio.c
+ * hands requests to blkrw/blkrwv, which queue them on the disk of the
+ * buffer's device and sleep until its driver has completed them.
+ * A driver pulls work with blk_dispatch whenever it is idle and
+ * reports each finished buffer with blk_done.  Each disk has its own
+ * queue and lock, so several disks can have I/O in flight at once.
+ *
+ * Devices are registered at boot in the blkdev table, indexed by device
+ * number.  A partition only adds its start sector to block numbers.
+ *
+ * Requests wait in one queue per direction, each kept both sorted by
+ * sector (the elevator, through snext/sprev) and in arrival
+ * order (the deadline FIFO, through fnext/fprev).  blk_dispatch serves
+ * reads before writes, sweeps each queue in ascending block order
+ * (C-SCAN) and hands out runs of consecutive blocks, which the driver
+ * turns into one multi-block transfer.  A request whose deadline has
+ * passed is served next, so neither direction is starved.
+ *
+ * Completions feed per-disk histograms of queueing and device latency.
+ * While tracing is turned on through the blktrace device, queue,
+ * dispatch and completion events also go to a ring read through it.
+ * Recording an event takes no lock: a slot is claimed by an atomic
+ * increment of the ring head and stamped with its sequence number
+ * once written, so the reader can tell it from an older or a
+ * half-written one.  blktrace.lock only serializes readers.
+ *
+ * Lock order is the driver's lock, then the disk's lock, then
+ * blktrace.lock.
+ */
+
+#include "types.h"
+#include "arm.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "console.h"
+#include "string.h"
+#include "buf.h"
+#include "file.h"
+#include "blk.h"
+
+struct blkdev blkdev[NBLKDEV];
+
+static uint64_t ticks_per_ms;
+
+/* A ring slot: the event, and 1 + its index once it is written, else 0. */
+struct blktrace_slot {
+    uint64_t seq;
+    struct blktrace_event ev;
+};
+
+struct {
+    struct spinlock lock;
+    struct blktrace_slot slot[BLKTRACE_NEVENT];
+    int on;                 /* Recording events */
+    uint64_t head;          /* Events recorded */
+    uint64_t tail;          /* Events read */
+    uint64_t lost;
+} blktrace;
+
+static ssize_t blktrace_read(struct inode* ip, char* dst, ssize_t n);
+static ssize_t blktrace_write(struct inode* ip, char* src, ssize_t n);
+
+void
+blk_init()
+{
+    uint64_t f;
+
+    asm volatile ("mrs %[freq], cntfrq_el0" : [freq] "=r"(f));
+    ticks_per_ms = f / 1000;
+
+    initlock(&blktrace.lock, "blktrace");
+    devsw[BLKTRACE_MAJOR].read = blktrace_read;
+    devsw[BLKTRACE_MAJOR].write = blktrace_write;
+}
+
+static void
+blk_trace(struct blkdev* d, int action, uint32_t sector, int nblk, int write, uint64_t ts)
+{
+    struct blktrace_slot* s;
+    uint64_t i;
+
+    if (!__atomic_load_n(&blktrace.on, __ATOMIC_RELAXED))
+        return;
+    i = __atomic_fetch_add(&blktrace.head, 1, __ATOMIC_RELAXED);
+    s = &blktrace.slot[i % BLKTRACE_NEVENT];
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->ev.ts = ts;
+    s->ev.sector = sector;
+    s->ev.nblk = nblk;
+    s->ev.dev = d->dev;
+    s->ev.action = action;
+    s->ev.write = write;
+    __atomic_store_n(&s->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/* Account ticks to the log2 microsecond histogram h, return microseconds. */
+static uint64_t
+blk_hist(uint64_t* h, uint64_t ticks)
+{
+    uint64_t us = ticks * 1000 / ticks_per_ms;
+    int i = us ? 63 - __builtin_clzll(us) : 0;
+
+    h[MIN(i, BLKLAT_NBUCKET - 1)]++;
+    return us;
+}
+
+/*
+ * Read the events recorded since the last read, or with minor
+ * BLKTRACE_LAT, the latency histograms of every disk.
+ */
+static ssize_t
+blktrace_read(struct inode* ip, char* dst, ssize_t n)
+{
+    struct blktrace_slot* s;
+    struct blkdev* d;
+    uint64_t head, seq;
+    ssize_t m = 0;
+
+    if (ip->minor == BLKTRACE_LAT) {
+        for (d = blkdev; d < blkdev + NBLKDEV && m + (ssize_t)sizeof(d->lat) <= n; d++) {
+            if (d->disk != d)
+                continue;
+            acquire(&d->lock);
+            memmove(dst + m, &d->lat, sizeof(d->lat));
+            release(&d->lock);
+            acquire(&blktrace.lock);
+            ((struct blklat*)(dst + m))->lost = blktrace.lost;
+            release(&blktrace.lock);
+            m += sizeof(d->lat);
+        }
+        return m;
+    }
+
+    acquire(&blktrace.lock);
+    head = __atomic_load_n(&blktrace.head, __ATOMIC_RELAXED);
+    if (head - blktrace.tail > BLKTRACE_NEVENT) {
+        blktrace.lost += head - blktrace.tail - BLKTRACE_NEVENT;
+        blktrace.tail = head - BLKTRACE_NEVENT;
+    }
+    for (; blktrace.tail < head && m + (ssize_t)sizeof(struct blktrace_event) <= n; blktrace.tail++) {
+        s = &blktrace.slot[blktrace.tail % BLKTRACE_NEVENT];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq < blktrace.tail + 1)    // Still being written, read it next time.
+            break;
+        memmove(dst + m, &s->ev, sizeof(struct blktrace_event));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != blktrace.tail + 1 || __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+            blktrace.lost++;            // Overwritten by a later event.
+        else
+            m += sizeof(struct blktrace_event);
+    }
+    release(&blktrace.lock);
+    return m;
+}
+
+/*
+ * Writing "1" to minor BLKTRACE_EVENTS turns event recording on,
+ * dropping the events recorded before; writing "0" turns it off.
+ */
+static ssize_t
+blktrace_write(struct inode* ip, char* src, ssize_t n)
+{
+    if (ip->minor != BLKTRACE_EVENTS || n < 1 || (src[0] != '0' && src[0] != '1'))
+        return -1;
+    acquire(&blktrace.lock);
+    if (src[0] == '1' && !blktrace.on)
+        blktrace.tail = __atomic_load_n(&blktrace.head, __ATOMIC_RELAXED);
+    __atomic_store_n(&blktrace.on, src[0] == '1', __ATOMIC_RELAXED);
+    release(&blktrace.lock);
+    return n;
+}
+
+/* Register a whole disk of size blocks, driven through ops. */
+struct blkdev*
+blk_register(int dev, const char* name, const struct blkops* ops,
+    void* priv, uint32_t size, int maxrun)
+{
+    struct blkdev* d = &blkdev[dev];
+
+    if (dev < 0 || dev >= NBLKDEV || d->disk)
+        panic("blk_register: bad device %d", dev);
+
+    strncpy(d->name, name, sizeof(d->name) - 1);
+    memmove(d->lat.name, d->name, sizeof(d->name));
+    d->lat.dev = dev;
+    d->lat.ticks_per_us = ticks_per_ms / 1000;
+    d->dev = dev;
+    d->disk = d;
+    d->start = 0;
+    d->size = size;
+    d->ops = ops;
+    d->priv = priv;
+    d->maxrun = maxrun;
+    initlock(&d->lock, d->name);
+    cprintf("blk: %s dev %d, %d blocks\n", d->name, dev, size);
+    return d;
+}
+
+/*
+ * Register the primary partitions found in the MBR of disk
+ * as devices disk->dev + 1 to disk->dev + 4.
+ *
+ * See https://en.wikipedia.org/wiki/Master_boot_record
+ */
+void
+blk_add_partitions(struct blkdev* disk, uint8_t* mbr)
+{
+    struct blkdev* d;
+    uint8_t* e;
+    int i;
+
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA) {
+        cprintf("blk: %s has no MBR\n", disk->name);
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        e = mbr + 0x1BE + 16 * i;
+        if (e[4] == 0 || disk->dev + 1 + i >= NBLKDEV)
+            continue;
+        d = &blkdev[disk->dev + 1 + i];
+        memmove(d->name, disk->name, sizeof(d->name));
+        d->name[strlen(d->name)] = '1' + i;
+        d->dev = disk->dev + 1 + i;
+        d->disk = disk;
+        d->start = e[8] | e[9] << 8 | e[10] << 16 | (uint32_t)e[11] << 24;
+        d->size = e[12] | e[13] << 8 | e[14] << 16 | (uint32_t)e[15] << 24;
+        cprintf("blk: %s dev %d, type 0x%x, start 0x%x, %d blocks\n",
+            d->name, d->dev, e[4], d->start, d->size);
+    }
+}
+
+static void
+blkq_insert(struct blkq* q, struct buf* b)
+{
+    struct buf* p;
+
+    /* Walk back from the tail, so ascending streams insert in O(1). */
+    for (p = q->tail; p && blk_sector(p) > blk_sector(b); p = p->sprev)
+        ;
+    b->sprev = p;
+    b->snext = p ? p->snext : q->head;
+    if (b->snext)
+        b->snext->sprev = b;
+    else
+        q->tail = b;
+    if (p)
+        p->snext = b;
+    else
+        q->head = b;
+
+    b->fprev = q->fifo_tail;
+    b->fnext = 0;
+    if (q->fifo_tail)
+        q->fifo_tail->fnext = b;
+    else
+        q->fifo = b;
+    q->fifo_tail = b;
+
+    /* Keep the elevator on the first request at or after its position. */
+    if (blk_sector(b) >= q->pos && (q->next == 0 || blk_sector(q->next) < q->pos ||
+        blk_sector(b) < blk_sector(q->next)))
+        q->next = b;
+    else if (q->next == 0 || blk_sector(q->next) < q->pos)
+        q->next = q->head;
+    q->n++;
+}
+
+static void
+blkq_remove(struct blkq* q, struct buf* b)
+{
+    if (b->sprev)
+        b->sprev->snext = b->snext;
+    else
+        q->head = b->snext;
+    if (b->snext)
+        b->snext->sprev = b->sprev;
+    else
+        q->tail = b->sprev;
+
+    if (b->fprev)
+        b->fprev->fnext = b->fnext;
+    else
+        q->fifo = b->fnext;
+    if (b->fnext)
+        b->fnext->fprev = b->fprev;
+    else
+        q->fifo_tail = b->fprev;
+
+    if (q->next == b)
+        q->next = b->snext ? b->snext : q->head;
+    q->n--;
+}
+
+/*
+ * Queue n locked bufs without waiting for them.
+ * A buf with B_ASYNC set is released by the completion, see blk_done.
+ */
+void
+blk_submit(struct buf** bv, int n)
+{
+    uint64_t now = timestamp();
+    struct blkdev* d;
+    int i, rw, depth;
+
+    for (i = 0; i < n; i++) {
+        if (bv[i]->dev >= NBLKDEV || (d = blkdev[bv[i]->dev].disk) == 0)
+            panic("blk_submit: no device %d", bv[i]->dev);
+        if (bv[i]->blockno >= blkdev[bv[i]->dev].size)
+            panic("blk_submit: %s block %d out of range", blkdev[bv[i]->dev].name, bv[i]->blockno);
+
+        acquire(&d->lock);
+        rw = bv[i]->flags & B_DIRTY ? BLK_WRITE : BLK_READ;
+        bv[i]->qtime = now;
+        bv[i]->expire = now + ticks_per_ms *
+            (rw == BLK_WRITE ? BLK_WRITE_EXPIRE : BLK_READ_EXPIRE);
+        blkq_insert(&d->q[rw], bv[i]);
+        blk_trace(d, BT_QUEUE, blk_sector(bv[i]), 1, rw, now);
+
+        depth = d->q[BLK_READ].n + d->q[BLK_WRITE].n;
+        d->st.nreq[rw]++;
+        d->st.depth_sum += depth;
+        if (depth > d->st.depth_max)
+            d->st.depth_max = depth;
+        release(&d->lock);
+
+        /* Kick once per run of requests for the same disk. */
+        if (i + 1 == n || blkdev[bv[i + 1]->dev].disk != d)
+            d->ops->kick(d);
+    }
+}
+
+/*
+ * Queue n bufs and wait until all of them are synced with disk.
+ * If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+ * Else if B_VALID is not set, read buf from disk, set B_VALID.
+ */
+void
+blkrwv(struct buf** bv, int n)
+{
+    int i;
+
+    blk_submit(bv, n);
+    for (i = 0; i < n; i++)
+        blk_wait(bv[i]);
+}
+
+/* Wait for a request queued by blk_submit without B_ASYNC. */
+void
+blk_wait(struct buf* b)
+{
+    struct blkdev* d = blkdev[b->dev].disk;
+
+    acquire(&d->lock);
+    while (!(b->flags & B_VALID) || (b->flags & B_DIRTY))
+        sleep(b, &d->lock);
+    release(&d->lock);
+}
+
+void
+blkrw(struct buf* b)
+{
+    blkrwv(&b, 1);
+}
+
+/*
+ * Pick the next run of requests of disk d for its driver, chained
+ * through qnext in ascending sector order, or 0 if nothing is queued.
+ * Called by the driver, usually with its own lock held.
+ */
+struct buf*
+blk_dispatch(struct blkdev* d)
+{
+    struct blkq* q;
+    struct buf* b, * run, * last;
+    uint64_t now = timestamp();
+    int rw, n;
+
+    acquire(&d->lock);
+    if (d->q[BLK_READ].n == 0 && d->q[BLK_WRITE].n == 0) {
+        release(&d->lock);
+        return 0;
+    }
+
+    if (d->q[BLK_READ].n == 0)
+        rw = BLK_WRITE;
+    else if (d->q[BLK_WRITE].n == 0)
+        rw = BLK_READ;
+    else if (d->starved >= BLK_WRITES_STARVED || d->q[BLK_WRITE].fifo->expire <= now)
+        rw = BLK_WRITE;
+    else
+        rw = BLK_READ;
+
+    if (rw == BLK_READ && d->q[BLK_WRITE].n)
+        d->starved++;
+    else if (rw == BLK_WRITE)
+        d->starved = 0;
+
+    q = &d->q[rw];
+    if (q->fifo->expire <= now) {
+        b = q->fifo;
+        d->st.nexpire++;
+    } else {
+        b = q->next;
+    }
+
+    /* Extend the run with the requests for the following sectors. */
+    run = last = b;
+    for (n = 1; n < d->maxrun && last->snext && blk_sector(last->snext) == blk_sector(last) + 1; n++)
+        last = last->snext;
+    for (b = run; ; b = b->qnext) {
+        blkq_remove(q, b);
+        b->dtime = now;
+        b->qnext = b == last ? 0 : b->snext;
+        if (b == last)
+            break;
+    }
+    q->pos = blk_sector(last) + 1;
+    d->st.ndispatch[rw]++;
+    blk_trace(d, BT_DISPATCH, blk_sector(run), n, rw, now);
+    release(&d->lock);
+    return run;
+}
+
+/* Called by the driver once b is synced with disk. */
+void
+blk_done(struct buf* b)
+{
+    struct blkdev* d = blkdev[b->dev].disk;
+    uint64_t now = timestamp();
+
+    acquire(&d->lock);
+    blk_trace(d, BT_COMPLETE, blk_sector(b), 1, (b->flags & B_DIRTY) != 0, now);
+    d->lat.n++;
+    d->lat.sum_queue += blk_hist(d->lat.queue, b->dtime - b->qtime);
+    d->lat.sum_device += blk_hist(d->lat.device, now - b->dtime);
+    blk_hist(d->lat.total, now - b->qtime);
+
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if (b->flags & B_ASYNC) {
+        b->flags &= ~B_ASYNC;
+        brelse_async(b);
+    } else {
+        wakeup(b);
+    }
+    release(&d->lock);
+}
+
+/* Statistics of the disk holding dev. */
+void
+blkstat(int dev, struct blkstat* st)
+{
+    struct blkdev* d = blkdev[dev].disk;
+
+    acquire(&d->lock);
+    *st = d->st;
+    release(&d->lock);
+}
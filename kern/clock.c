@@ -4,6 +4,8 @@
 #include "peripherals/irq.h"
 
 #include "console.h"
+#include "buf.h"
+#include "log.h"
 
 void
 clock_init()
@@ -28,4 +30,6 @@ void
 clock()
 {
     // cprintf("clock: cpu %d clock.\n", cpuid());
+    bflush_tick();
+    log_tick();
 }
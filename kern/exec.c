@@ -23,6 +23,7 @@ execve(const char* path, char* const argv[], char* const envp[])
     Elf64_Ehdr elf;
     struct inode* ip;
     Elf64_Phdr ph;
+    struct ra_state ra = { 0 };
     uint64_t* pgdir, * oldpgdir;
     char* s, * last;
     int i, off;
@@ -39,6 +40,10 @@ execve(const char* path, char* const argv[], char* const envp[])
     ilock(ip);
     pgdir = 0;
 
+    // The whole image is about to be read, start fetching it.
+    for (sz = 0; sz < ip->size; sz += RA_MAX * BSIZE)
+        readahead(ip, &ra, sz, RA_MAX * BSIZE);
+
     if (readi(ip, (char*)&elf, 0, sizeof(elf)) < sizeof(elf))
         goto bad;
 
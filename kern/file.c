@@ -7,6 +7,8 @@
 #include "file.h"
 #include "console.h"
 #include "log.h"
+#include "mmu.h"
+#include "pcache.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -109,8 +111,22 @@ filestat(struct file* f, struct stat* st)
 ssize_t
 fileread(struct file* f, char* addr, ssize_t n)
 {
-    /* TODO: Your code here. */
-    ssize_t r;
+    struct iovec iov = { addr, n };
+
+    return filereadv(f, &iov, 1, &f->off);
+}
+
+/*
+ * Read from file f at *off into the cnt buffers of iov, in order,
+ * under one lock of the inode, and advance *off.  Stop at the end
+ * of the file.  Only reads at the file offset drive readahead.
+ */
+ssize_t
+filereadv(struct file* f, struct iovec* iov, int cnt, size_t* off)
+{
+    ssize_t r, tot = 0;
+    int i;
+
     if (f->readable == 0) {
         return -1;
     }
@@ -118,27 +134,124 @@ fileread(struct file* f, char* addr, ssize_t n)
 
     case FD_INODE:
         ilock(f->ip);
-        r = readi(f->ip, addr, f->off, n);
-        if (r > 0) {
-            f->off += r;
+        for (i = 0; i < cnt; i++) {
+            if (off == &f->off)
+                readahead(f->ip, &f->ra, *off, iov[i].iov_len);
+            r = readi(f->ip, iov[i].iov_base, *off, iov[i].iov_len);
+            if (r < 0) {
+                if (tot == 0)
+                    tot = -1;
+                break;
+            }
+            *off += r;
+            tot += r;
+            if (r < iov[i].iov_len)
+                break;
         }
         iunlock(f->ip);
-        return r;
+        return tot;
     default:
         panic("fileread");
     }
     return 0;
 }
 
+/*
+ * Read directory entries of file f into addr as linux_dirent64
+ * records, at most n bytes.  Return the bytes read, 0 at the end,
+ * or -1 if f is not a directory or n fits no entry.
+ */
+ssize_t
+filereaddir(struct file* f, char* addr, ssize_t n)
+{
+    ssize_t r;
+
+    if (f->readable == 0 || f->type != FD_INODE)
+        return -1;
+    ilock(f->ip);
+    if (f->ip->type != T_DIR) {
+        iunlock(f->ip);
+        return -1;
+    }
+    r = dirread(f->ip, addr, &f->off, n);
+    if (r == 0 && f->off < f->ip->size)
+        r = -1;
+    iunlock(f->ip);
+    return r;
+}
+
+/*
+ * Copy up to n bytes of regular file in, from *off on, to file out.
+ * The data is written straight from in's page cache, a page at a
+ * time, without a bounce buffer; inline data is copied out first.
+ * Advance *off, and return the bytes copied, fewer than n at the end
+ * of in.
+ */
+ssize_t
+filesend(struct file* out, struct file* in, size_t* off, size_t n)
+{
+    char data[NINLINE];
+    struct page* pg;
+    size_t tot, m;
+    ssize_t r;
+
+    if (!in->readable || in->type != FD_INODE || !out->writable)
+        return -1;
+
+    for (tot = 0; tot < n; tot += m, *off += m) {
+        ilock(in->ip);
+        if (in->ip->type != T_FILE) {
+            iunlock(in->ip);
+            return -1;
+        }
+        if (*off >= in->ip->size) {
+            iunlock(in->ip);
+            break;
+        }
+        m = MIN(n - tot, PGSIZE - *off % PGSIZE);
+        m = MIN(m, in->ip->size - *off);
+        if (INLINE_DATA(in->ip->type, in->ip->size)) {
+            readi(in->ip, data, *off, m);
+            iunlock(in->ip);
+            r = filewrite(out, data, m);
+        } else {
+            if (off == &in->off)
+                readahead(in->ip, &in->ra, *off, m);
+            pg = ipage(in->ip, *off, m);
+            iunlock(in->ip);
+            r = filewrite(out, pg->data + *off % PGSIZE, m);
+            pput(pg);
+        }
+        if (r != m)
+            return tot ? tot : -1;
+    }
+    return tot;
+}
+
 /* Write to file f. */
 ssize_t
 filewrite(struct file* f, char* addr, ssize_t n)
+{
+    struct iovec iov = { addr, n };
+
+    return filewritev(f, &iov, 1, &f->off);
+}
+
+/*
+ * Write the cnt buffers of iov to file f at *off, in order, and
+ * advance *off.  When they fit in one transaction, all of them are
+ * written in it under one lock of the inode; otherwise each is
+ * written in as many transactions as it needs.
+ */
+ssize_t
+filewritev(struct file* f, struct iovec* iov, int cnt, size_t* off)
 {
     /* TODO: Your code here. */
     // acquire(&ftable.lock);
     ssize_t n1;
     ssize_t r;
-    int max;
+    size_t max, i, n, tot;
+    int j;
     if (!f->writable) {
         return -1;
     }
@@ -146,36 +259,53 @@ filewrite(struct file* f, char* addr, ssize_t n)
     switch (f->type) {
 
     case FD_INODE:
-        max = ((LOGSIZE - 4) >> 1) * 512;
-        int i;
-        for (i = 0; i < n;) {
-            r = MIN(max, n - i);
+        max = log_ordered() ? LOG_ORDERED_MAXWRITE : LOG_JOURNAL_MAXWRITE;
+        for (j = 0, tot = 0; j < cnt; j++)
+            tot += iov[j].iov_len;
+        if (tot <= max) {
             begin_op();
             ilock(f->ip);
-
-            n1 = writei(f->ip, addr + i, f->off, r);
-            if (n1 > 0) {
-                f->off += n1;
+            for (j = 0, tot = 0; j < cnt; j++) {
+                n1 = writei(f->ip, iov[j].iov_base, *off, iov[j].iov_len);
+                if (n1 < 0)
+                    break;
+                *off += n1;
+                tot += n1;
             }
-
             iunlock(f->ip);
             end_op();
+            return j < cnt && tot == 0 ? -1 : tot;
+        }
 
-            if (n1 < 0) {
-                panic("filewrite: n1 < 0 \n");
-            }
+        for (j = 0, tot = 0; j < cnt; j++) {
+            n = iov[j].iov_len;
+            for (i = 0; i < n;) {
+                r = MIN(max, n - i);
+                begin_op();
+                ilock(f->ip);
 
-            if (n1 < r) {
-                panic("filewrite: n1 < r");
+                n1 = writei(f->ip, (char*)iov[j].iov_base + i, *off, r);
+                if (n1 > 0) {
+                    *off += n1;
+                }
+
+                iunlock(f->ip);
+                end_op();
+
+                if (n1 < 0) {
+                    return tot ? tot : -1;
+                }
+
+                if (n1 < r) {
+                    panic("filewrite: n1 < r");
+                }
+                i += r;
+                tot += r;
             }
-            i += r;
         }
-        return i == n ? n : -1;
-        break;
+        return tot;
     default:
         panic("filewrite: no type");
     }
     return -1;
 }
-
-
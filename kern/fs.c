@@ -12,26 +12,45 @@
  */
 
 #include "types.h"
+#include "arm.h"
 #include "mmu.h"
 #include "proc.h"
 #include "string.h"
 #include "console.h"
 
+#include "kalloc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 
 #include "buf.h"
 #include "log.h"
 #include "file.h"
+#include "pcache.h"
 
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+#define BMAP_RUN 32     // Blocks readi() maps at a time.
+
 static void itrunc(struct inode*);
+static void dcache_init();
+static void dcache_purge(uint32_t dev, uint32_t inum);
+
+/* Mounted file systems, filled in by iinit(). */
+static struct mount mount[NMOUNT];
 
-// There should be one superblock per disk device,
-// but we run with only one device.
-struct superblock sb;
+/* Return the mount of dev, which iinit() must have mounted. */
+struct mount*
+getmount(uint32_t dev)
+{
+    struct mount* m;
+
+    for (m = mount; m < mount + NMOUNT; m++) {
+        if (m->valid && m->dev == dev)
+            return m;
+    }
+    panic("getmount: dev not mounted");
+}
 
 /* Read the super block. */
 void
@@ -47,49 +66,105 @@ readsb(int dev, struct superblock* sb)
     brelse(bp);
 }
 
-/* Zero a block. */
+/* Zero a block, of file data unless meta. */
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int meta)
 {
     /* TODO: Your code here. */
     struct buf* bp;
 
     bp = bread(dev, bno);
     memset(bp->data, 0, BSIZE);
-    log_write(bp);
+    if (meta)
+        log_write(bp);
+    else
+        log_write_data(bp);
     brelse(bp);
 }
 
-/* Blocks. */
+/* Blocks.
+ *
+ * Besides the on-disk bitmap, the allocator keeps a summary of each
+ * bitmap block in memory: how many blocks it maps are free, and a bit
+ * below which none are.  balloc() skips full bitmap blocks without
+ * reading them, and searches the others 64 bits at a time onward from
+ * a goal, the last block allocated to the same inode, so a file's
+ * blocks are placed contiguously.  Inode allocation keeps an
+ * in-memory bitmap of the inodes in use and searches it the same way.
+ *
+ * The summaries are built by iinit() and kept up to date under the
+ * bitmap block's buffer lock, which serializes all changes to it;
+ * the mount's lock guards the hints, counters and inode bitmap.
+ */
+
+/* Return the first clear bit in [from, n) of map, or n if there is none. */
+static uint32_t
+bitmap_find(const void* map, uint32_t from, uint32_t n)
+{
+    const uint64_t* w = map;
+    uint64_t x;
+    uint32_t i;
+
+    for (i = from / 64; i * 64 < n; i++) {
+        x = ~w[i];
+        if (i == from / 64)
+            x &= ~0ULL << (from % 64);
+        if (x)
+            return MIN(i * 64 + ctz64(x), n);
+    }
+    return n;
+}
 
-/* Allocate a zeroed disk block. */
+/*
+ * Allocate a zeroed disk block, to hold file data unless meta,
+ * as close after goal as possible, or after the last allocation if 0.
+ * Blocks the log may still replay, or that a transaction not yet
+ * committed freed, are not used for file data (see log_busy()).
+ */
 static uint32_t
-balloc(uint32_t dev)
+balloc(uint32_t dev, int meta, uint32_t goal)
 {
     /* TODO: Your code here. */
-    int b, bi, m;
+    struct mount* m = getmount(dev);
+    uint32_t g, i, bi, from, end, b;
+    struct bmsum* s;
     struct buf* bp;
-    struct superblock sb;
 
-    bp = 0;
-    readsb(dev, &sb);
+    if (goal == 0 || goal >= m->sb.size)
+        goal = m->rotor;
+    g = goal / BPB;
 
-    for (b = 0; b < sb.size; b += BPB) {
-        bp = bread(dev, BBLOCK(b, sb));
-
-        for (bi = 0; bi < BPB && (b + bi) < sb.size; bi++) {
-            m = 1 << (bi & 0x7); // the bitnum in a bitmap block
-
-            if ((bp->data[bi >> 3] & m) == 0) { // means that the block pointed by the bit of the bit map is free
-                bp->data[bi >> 3] |= m;//set the bit in the bitmap to 1 to shows it is occupied
-                log_write(bp);
-                brelse(bp);
-                bzero(dev, b + bi);
-                return b + bi;
-            }
+    // Try the goal's bitmap block from the goal on, the others from
+    // their first free bit, and finally the goal's again from its start.
+    for (i = 0; i <= m->nbmap; i++, g = (g + 1) % m->nbmap) {
+        s = &m->sum[g];
+        if (s->nfree == 0)
+            continue;
+        bp = bread(dev, m->sb.bmapstart + g);
+        from = i == 0 ? MAX(goal % BPB, s->first) : s->first;
+        end = MIN(m->sb.size - g * BPB, BPB);
+        for (bi = bitmap_find(bp->data, from, end); bi < end; bi = bitmap_find(bp->data, bi + 1, end)) {
+            if (meta || !log_busy(g * BPB + bi))
+                break;
+        }
+        if (bi == end) {
+            brelse(bp);
+            continue;
         }
 
+        b = g * BPB + bi;
+        bp->data[bi >> 3] |= 1 << (bi & 7);
+        log_write(bp);
+        acquire(&m->lock);
+        s->nfree--;
+        m->nfree--;
+        if (from == s->first)
+            s->first = bitmap_find(bp->data, from, end);
+        m->rotor = b + 1;
+        release(&m->lock);
         brelse(bp);
+        bzero(dev, b, meta);
+        return b;
     }
     return -1;
 }
@@ -99,23 +174,76 @@ static void
 bfree(int dev, uint32_t b)
 {
     /* TODO: Your code here. */
+    struct mount* m = getmount(dev);
     struct buf* bp;
-    struct superblock sb;
-    int bi, m;
+    struct bmsum* s;
+    int bi, mask;
 
-    readsb(dev, &sb);
-    bp = bread(dev, BBLOCK(b, sb));
+    bp = bread(dev, BBLOCK(b, m->sb));
     bi = b % BPB;
-    m = 1 << (bi & 0x7);
+    mask = 1 << (bi & 0x7);
 
-    if ((bp->data[bi >> 3] & m) == 0)
+    if ((bp->data[bi >> 3] & mask) == 0)
         panic("freeing free block");
 
-    bp->data[bi >> 3] &= ~m;
+    bp->data[bi >> 3] &= ~mask;
     log_write(bp);
+    log_freed(b);
+    s = &m->sum[b / BPB];
+    acquire(&m->lock);
+    s->nfree++;
+    m->nfree++;
+    s->first = MIN(s->first, bi);
+    release(&m->lock);
     brelse(bp);
 }
 
+/*
+ * Build m's summaries of its block bitmap and its bitmap of inodes
+ * in use, and count the free blocks and inodes.
+ */
+static void
+fsalloc_init(struct mount* m)
+{
+    struct buf* bp = 0;
+    struct dinode* dip;
+    uint32_t g, bi, end, inum;
+    int dev = m->dev;
+
+    initlock(&m->lock, "mount");
+    if (m->nbmap * sizeof(struct bmsum) > PGSIZE || m->sb.ninodes > PGSIZE * 8)
+        panic("fsalloc_init: file system too big");
+    if ((m->sum = (struct bmsum*)kalloc()) == 0 || (m->imap = (uint64_t*)kalloc()) == 0)
+        panic("fsalloc_init: out of memory");
+
+    for (g = 0; g < m->nbmap; g++) {
+        bp = bread(dev, m->sb.bmapstart + g);
+        end = MIN(m->sb.size - g * BPB, BPB);
+        m->sum[g].first = bitmap_find(bp->data, 0, end);
+        m->sum[g].nfree = 0;
+        for (bi = m->sum[g].first; bi < end; bi = bitmap_find(bp->data, bi + 1, end))
+            m->sum[g].nfree++;
+        m->nfree += m->sum[g].nfree;
+        brelse(bp);
+    }
+    m->rotor = m->datastart;
+
+    memset(m->imap, 0, PGSIZE);
+    for (inum = 0; inum < m->sb.ninodes; inum++) {
+        if (inum % IPB == 0)
+            bp = bread(dev, IBLOCK(inum, m->sb));
+        dip = (struct dinode*)bp->data + inum % IPB;
+        if (dip->type)
+            m->imap[inum / 64] |= 1ULL << (inum % 64);
+        if (inum % IPB == IPB - 1 || inum == m->sb.ninodes - 1)
+            brelse(bp);
+    }
+    m->imap[0] |= 1;   // Inode 0 is never allocated.
+    m->ifirst = bitmap_find(m->imap, 1, m->sb.ninodes);
+    for (inum = m->ifirst; inum < m->sb.ninodes; inum = bitmap_find(m->imap, inum + 1, m->sb.ninodes))
+        m->nifree++;
+}
+
 /* Inodes.
  *
  * An inode describes a single unnamed file.
@@ -184,33 +312,134 @@ bfree(int dev, uint32_t b)
  * An ip->lock sleep-lock protects all ip-> fields other than ref,
  * dev, and inum.  One must hold ip->lock in order to
  * read or write that inode's ip->valid, ip->size, ip->type, &c.
+ *
+ * Cached inodes are hashed by (dev, inum).  An inode whose ref
+ * drops to 0 stays hashed, and valid, on an LRU list, so opening
+ * a file again soon needs no disk read; iget() recycles the least
+ * recently used one on a miss.  When all inodes are referenced,
+ * the cache grows by a page of inodes, up to NINODE_MAX.
  */
 
+#define ICACHE_NHASH 64
+
 struct {
     struct spinlock lock;
-    struct inode inode[NINODE];
+    struct inode* hash[ICACHE_NHASH];
+    struct inode* mru;  /* Circular LRU list; mru->prev is least recent. */
+    int ninode;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t evict;
 } icache;
 
+static struct inode**
+ihash(uint32_t dev, uint32_t inum)
+{
+    uint32_t h = (inum ^ (dev << 24)) * 2654435761u;
+    return &icache.hash[(h >> 8) & (ICACHE_NHASH - 1)];
+}
+
+/*
+ * Insert unreferenced ip into the LRU list, as most recently used
+ * if it is still valid, else as the first to recycle.
+ * Caller holds icache.lock.
+ */
+static void
+lru_insert(struct inode* ip)
+{
+    if (icache.mru == 0) {
+        ip->next = ip->prev = ip;
+    } else {
+        ip->next = icache.mru;
+        ip->prev = icache.mru->prev;
+        icache.mru->prev->next = ip;
+        icache.mru->prev = ip;
+    }
+    icache.mru = ip->valid ? ip : ip->next;
+}
+
+/* Unlink ip from the LRU list. Caller holds icache.lock. */
+static void
+lru_remove(struct inode* ip)
+{
+    if (ip->next == ip) {
+        icache.mru = 0;
+    } else {
+        ip->next->prev = ip->prev;
+        ip->prev->next = ip->next;
+        if (icache.mru == ip)
+            icache.mru = ip->next;
+    }
+    ip->next = ip->prev = 0;
+}
+
+/* Add a page of inodes to the cache. Caller holds icache.lock. */
+static int
+icache_grow()
+{
+    struct inode* ip;
+    char* p;
+
+    if (icache.ninode >= NINODE_MAX || (p = kalloc()) == 0)
+        return -1;
+    memset(p, 0, PGSIZE);
+    for (ip = (struct inode*)p; ip < (struct inode*)p + PGSIZE / sizeof(struct inode); ip++) {
+        initsleeplock(&ip->lock, "inode");
+        lru_insert(ip);
+        icache.ninode++;
+    }
+    return 0;
+}
+
 void
 iinit(int dev)
 {
     /* TODO: Your code here. */
-    int i = 0;
+    struct mount* m;
 
-    initlock(&icache.lock, "icache");
-    for (i = 0; i < NINODE; i++) {
-        initsleeplock(&icache.inode[i].lock, "inode");
+    if (!mount[0].valid) {
+        initlock(&icache.lock, "icache");
+        acquire(&icache.lock);
+        while (icache.ninode < NINODE) {
+            if (icache_grow() < 0)
+                panic("iinit: out of memory");
+        }
+        release(&icache.lock);
+        dcache_init();
     }
 
-    readsb(dev, &sb);
+    for (m = mount; m < mount + NMOUNT && m->valid; m++)
+        ;
+    if (m == mount + NMOUNT)
+        panic("iinit: too many mounts");
+    m->dev = dev;
+    readsb(dev, &m->sb);
+    m->nbmap = (m->sb.size + BPB - 1) / BPB;
+    m->datastart = m->sb.bmapstart + m->nbmap;
+    fsalloc_init(m);
+    m->valid = 1;
     cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
-        sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-        sb.bmapstart);
+ inodestart %d bmap start %d\n", m->sb.size, m->sb.nblocks,
+        m->sb.ninodes, m->sb.nlog, m->sb.logstart, m->sb.inodestart,
+        m->sb.bmapstart);
+    cprintf("mount: dev %d, %d free blocks, %d free inodes\n", dev, m->nfree, m->nifree);
 }
 
 static struct inode* iget(uint32_t dev, uint32_t inum);
 
+/* Mark inode inum of dev free in the allocator's inode bitmap. */
+static void
+ifree(uint32_t dev, uint32_t inum)
+{
+    struct mount* m = getmount(dev);
+
+    acquire(&m->lock);
+    m->imap[inum / 64] &= ~(1ULL << (inum % 64));
+    m->ifirst = MIN(m->ifirst, inum);
+    m->nifree++;
+    release(&m->lock);
+}
+
 /* Allocate an inode on device dev.
  *
  * Mark it as allocated by giving it type type.
@@ -220,25 +449,30 @@ struct inode*
     ialloc(uint32_t dev, short type)
 {
     /* TODO: Your code here. */
-    int inum;
+    struct mount* m = getmount(dev);
+    uint32_t inum;
     struct buf* bp;
     struct dinode* dip;
 
-    struct superblock sb;
-    readsb(dev, &sb);
+    acquire(&m->lock);
+    inum = bitmap_find(m->imap, m->ifirst, m->sb.ninodes);
+    if (inum < m->sb.ninodes) {
+        m->imap[inum / 64] |= 1ULL << (inum % 64);
+        m->ifirst = inum + 1;
+        m->nifree--;
+    }
+    release(&m->lock);
 
-    for (inum = 1; inum < sb.ninodes; inum++) {
-        bp = bread(dev, IBLOCK(inum, sb));
+    if (inum < m->sb.ninodes) {
+        bp = bread(dev, IBLOCK(inum, m->sb));
         dip = (struct dinode*)bp->data + inum % IPB; //get the corresponding inode in the block of bp
-
-        if (dip->type == 0) { //free
-            memset(dip, 0, sizeof(*dip));
-            dip->type = type;
-            log_write(bp);
-            brelse(bp);
-            return iget(dev, inum);
-        }
+        if (dip->type != 0)
+            panic("ialloc: inode bitmap");
+        memset(dip, 0, sizeof(*dip));
+        dip->type = type;
+        log_write(bp);
         brelse(bp);
+        return iget(dev, inum);
     }
 
     panic("ialloc: no inodes");
@@ -255,10 +489,8 @@ iupdate(struct inode* ip)
 {
     struct buf* bp;
     struct dinode* dip;
-    struct superblock sb;
-    readsb(ip->dev, &sb);
 
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread(ip->dev, IBLOCK(ip->inum, getmount(ip->dev)->sb));
 
     dip = (struct dinode*)bp->data + ip->inum % IPB;
 
@@ -283,38 +515,59 @@ static struct inode*
 iget(uint32_t dev, uint32_t inum)
 {
     /* TODO: Your code here. */
-    struct inode* ip, * empty;
+    struct inode* ip, ** pp;
 
     acquire(&icache.lock);
 
     // Is the inode already cached?
-    empty = 0;
-
-    for (ip = icache.inode; ip < icache.inode + NINODE; ip++) {
-        //get an active entry
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-            ip->ref++;
+    for (ip = *ihash(dev, inum); ip; ip = ip->hnext) {
+        if (ip->dev == dev && ip->inum == inum) {
+            if (ip->ref++ == 0)
+                lru_remove(ip);
+            icache.hit++;
             release(&icache.lock);
-            // cprintf("ip:0x%llx", ip);
             return ip;
         }
-        if (empty == 0 && ip->ref == 0)    // Remember the first empty slot.
-            empty = ip;
     }
+    icache.miss++;
 
-    // cprintf("empty:0x%llx", empty);
-    // Recycle an inode cache entry.
-    if (empty == 0)
+    // Recycle the least recently used unreferenced entry.
+    if (icache.mru == 0 && icache_grow() < 0)
         panic("iget: no inodes");
+    ip = icache.mru->prev;
+    lru_remove(ip);
+    if (ip->inum) {
+        for (pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+            ;
+        *pp = ip->hnext;
+        if (ip->valid)
+            icache.evict++;
+        pdrop(ip);
+    }
 
-    //get the first empty slot
-    empty->dev = dev;
-    empty->inum = inum;
-    empty->ref = 1;
-    empty->valid = 0;
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->goal = 0;
+    pp = ihash(dev, inum);
+    ip->hnext = *pp;
+    *pp = ip;
 
     release(&icache.lock);
-    return empty;
+    return ip;
+}
+
+/* Report inode cache statistics. */
+void
+istat(struct istat* st)
+{
+    acquire(&icache.lock);
+    st->ninode = icache.ninode;
+    st->hit = icache.hit;
+    st->miss = icache.miss;
+    st->evict = icache.evict;
+    release(&icache.lock);
 }
 
 /*
@@ -340,17 +593,15 @@ ilock(struct inode* ip)
     /* TODO: Your code here. */
     struct buf* bp;
     struct dinode* dip;
-    struct superblock sb;
 
     // cprintf("%d", ip);
     if (ip == 0 || ip->ref < 1)
         panic("ilock");
 
     acquiresleep(&ip->lock);
-    readsb(ip->dev, &sb);
 
     if (ip->valid == 0) {//read inode from the disk
-        bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+        bp = bread(ip->dev, IBLOCK(ip->inum, getmount(ip->dev)->sb));
 
         dip = (struct dinode*)bp->data + ip->inum % IPB;
 
@@ -396,6 +647,8 @@ void
 iput(struct inode* ip)
 {
     /* TODO: Your code here. */
+    int dir;
+
     acquire(&icache.lock);
 
     if (ip->ref == 1 && (ip->valid) && ip->nlink == 0) {
@@ -406,17 +659,23 @@ iput(struct inode* ip)
         release(&icache.lock);
         acquiresleep(&ip->lock);
 
+        // Only a directory can have names in the dcache.
+        dir = ip->type == T_DIR;
         itrunc(ip);
         ip->type = 0;
         iupdate(ip);
         releasesleep(&ip->lock);
         acquire(&icache.lock);
         ip->valid = 0;
+        ifree(ip->dev, ip->inum);
+        if (dir)
+            dcache_purge(ip->dev, ip->inum);
 
         wakeup(ip);
     }
 
-    ip->ref--;
+    if (--ip->ref == 0)
+        lru_insert(ip);
     release(&icache.lock);
 }
 
@@ -434,8 +693,32 @@ iunlockput(struct inode* ip)
  * The content (data) associated with each inode is stored
  * in blocks on the disk. The first NDIRECT block numbers
  * are listed in ip->addrs[].  The next NINDIRECT blocks are
- * listed in block ip->addrs[NDIRECT].
- *
+ * listed in block ip->addrs[NDIRECT], the NINDIRECT^2 after
+ * those under the double indirect block ip->addrs[NDIRECT + 1],
+ * and the NINDIRECT^3 after those under the triple indirect
+ * block ip->addrs[NDIRECT + 2].
+ */
+
+/*
+ * Find which indirect tree holds block bn of an inode, past the
+ * direct blocks.  Return its level, with bn made relative to the
+ * tree and *span set to the number of blocks in it.
+ */
+static int
+bmap_level(uint32_t* bn, uint32_t* span)
+{
+    int level;
+
+    *bn -= NDIRECT;
+    for (level = 1, *span = NINDIRECT; level <= NLEVEL; level++, *span *= NINDIRECT) {
+        if (*bn < *span)
+            return level;
+        *bn -= *span;
+    }
+    panic("bmap: out of range");
+}
+
+/*
  * Return the disk block address of the nth block in inode ip.
  * If there is no such block, bmap allocates one.
  */
@@ -443,30 +726,89 @@ static uint32_t
 bmap(struct inode* ip, uint32_t bn)
 {
     /* TODO: Your code here. */
-    uint32_t addr, * a;
+    uint32_t addr, * a, span;
     struct buf* bp;
+    int meta = ip->type != T_FILE;
+    int level, l;
 
     if (bn < NDIRECT) {
         if ((addr = ip->addrs[bn]) == 0) // not allocated
-            ip->addrs[bn] = addr = balloc(ip->dev); // alloc one
+            ip->addrs[bn] = addr = ip->goal = balloc(ip->dev, meta, ip->goal); // alloc one
         return addr;
     }
-    bn -= NDIRECT;
+    level = bmap_level(&bn, &span);
 
-    if (bn < NINDIRECT) { // indirect pointer
-        if ((addr = ip->addrs[NDIRECT]) == 0)
-            ip->addrs[NDIRECT] = addr = balloc(ip->dev); //alloc one
+    if ((addr = ip->addrs[NDIRECT + level - 1]) == 0)
+        ip->addrs[NDIRECT + level - 1] = addr = ip->goal = balloc(ip->dev, 1, ip->goal); //alloc one
+    for (l = level; l > 0; l--) {
+        span /= NINDIRECT;  // Blocks under each entry of this level.
         bp = bread(ip->dev, addr);//get the indirect block
         a = (uint32_t*)bp->data;//read the indirect block's data
-        if ((addr = a[bn]) == 0) { //addr in indirect block
-            a[bn] = addr = balloc(ip->dev);
+        if ((addr = a[bn / span % NINDIRECT]) == 0) { //addr in indirect block
+            a[bn / span % NINDIRECT] = addr = ip->goal = balloc(ip->dev, l > 1 || meta, ip->goal);
             log_write(bp);
         }
         brelse(bp);
-        return addr;
     }
+    return addr;
+}
 
-    panic("bmap: out of range");
+/*
+ * Map the n blocks of ip from bn on into addr[], without allocating.
+ * Each indirect block is read once for the run of blocks it holds,
+ * so mapping a sequential run costs one lookup per NINDIRECT blocks.
+ * Blocks that are not allocated map to 0.
+ */
+static void
+bmap_run(struct inode* ip, uint32_t bn, uint32_t n, uint32_t* addr)
+{
+    uint32_t b, span, a;
+    struct buf* bp;
+    int level, l, i;
+
+    for (i = 0; i < n; ) {
+        b = bn + i;
+        if (b < NDIRECT) {
+            addr[i++] = ip->addrs[b];
+            continue;
+        }
+        level = bmap_level(&b, &span);
+        a = ip->addrs[NDIRECT + level - 1];
+        for (l = level; l > 1 && a; l--) {
+            span /= NINDIRECT;
+            bp = bread(ip->dev, a);
+            a = ((uint32_t*)bp->data)[b / span % NINDIRECT];
+            brelse(bp);
+        }
+        if (a == 0) {
+            addr[i++] = 0;
+            continue;
+        }
+        bp = bread(ip->dev, a);
+        for (b %= NINDIRECT; b < NINDIRECT && i < n; b++)
+            addr[i++] = ((uint32_t*)bp->data)[b];
+        brelse(bp);
+    }
+}
+
+/* Free block addr, and if it is an indirect block of level, the blocks under it. */
+static void
+bfree_tree(int dev, uint32_t addr, int level)
+{
+    struct buf* bp;
+    uint32_t* a;
+    int j;
+
+    if (level > 0) {
+        bp = bread(dev, addr);
+        a = (uint32_t*)bp->data;
+        for (j = 0; j < NINDIRECT; j++) {
+            if (a[j])
+                bfree_tree(dev, a[j], level - 1);
+        }
+        brelse(bp);
+    }
+    bfree(dev, addr);
 }
 
 /* Truncate inode (discard contents).
@@ -480,9 +822,14 @@ static void
 itrunc(struct inode* ip) // free all the addrs
 {
     /* TODO: Your code here. */
-    int i, j;
-    struct buf* bp;
-    uint32_t* a;
+    int i;
+
+    if (INLINE_DATA(ip->type, ip->size)) {
+        memset(ip->addrs, 0, sizeof(ip->addrs));
+        ip->size = 0;
+        iupdate(ip);
+        return;
+    }
 
     for (i = 0; i < NDIRECT; i++) {
         if (ip->addrs[i]) {
@@ -491,21 +838,14 @@ itrunc(struct inode* ip) // free all the addrs
         }
     }
 
-    if (ip->addrs[NDIRECT]) {
-        bp = bread(ip->dev, ip->addrs[NDIRECT]);
-        a = (uint32_t*)bp->data;
-
-        for (j = 0; j < NINDIRECT; j++) {
-            if (a[j]) {
-                bfree(ip->dev, a[j]);
-                a[j] = 0;
-            }
+    for (i = 0; i < NLEVEL; i++) {
+        if (ip->addrs[NDIRECT + i]) {
+            bfree_tree(ip->dev, ip->addrs[NDIRECT + i], i + 1);
+            ip->addrs[NDIRECT + i] = 0;
         }
-        brelse(bp);
-        bfree(ip->dev, ip->addrs[NDIRECT]);
-        ip->addrs[NDIRECT] = 0;
     }
 
+    pdrop(ip);
     ip->size = 0;
     iupdate(ip);
 }
@@ -538,8 +878,83 @@ stati(struct inode* ip, struct stat* st)
     }
 }
 
+/* Mask of the blocks of a page holding bytes [off, off+n) of it. */
+#define PAGE_BLOCKS(off, n) \
+    ((((1 << BPP) - 1) << (off) / BSIZE) & (((1 << BPP) - 1) >> (BPP - 1 - ((off) + (n) - 1) / BSIZE)))
+
+/*
+ * Return page index of regular file ip, referenced, with the blocks
+ * in mask read in.  Blocks not allocated read as zeroes.
+ * Caller must hold ip->lock.
+ */
+static struct page*
+getpage(struct inode* ip, uint32_t index, int mask)
+{
+    uint32_t addr[BPP];
+    struct page* pg;
+    struct buf* bp;
+    int i;
+
+    pg = pget(ip, index);
+    if ((mask &= ~pg->valid) == 0)
+        return pg;
+    bmap_run(ip, index * BPP, MIN(BPP, MAXFILE - index * BPP), addr);
+    for (i = 0; i < BPP && index * BPP + i < MAXFILE; i++) {
+        if (!(mask & (1 << i)))
+            continue;
+        if (addr[i] == 0) {
+            memset(pg->data + i * BSIZE, 0, BSIZE);
+        } else {
+            bp = bread(ip->dev, addr[i]);
+            memmove(pg->data + i * BSIZE, bp->data, BSIZE);
+            brelse(bp);
+        }
+    }
+    pg->valid |= mask;
+    return pg;
+}
+
+/*
+ * Write the dirty blocks of page pg of ip back through the buffer
+ * cache, allocating them as needed.  The page holds whole blocks, so
+ * the buffers are overwritten without reading the disk.
+ * Caller must hold ip->lock, inside a transaction.
+ */
+static void
+pflush(struct inode* ip, struct page* pg)
+{
+    struct buf* bp;
+    int i;
+
+    for (i = 0; i < BPP; i++) {
+        if (!(pg->dirty & (1 << i)))
+            continue;
+        bp = bgetblk(ip->dev, bmap(ip, pg->index * BPP + i));
+        memmove(bp->data, pg->data + i * BSIZE, BSIZE);
+        bp->flags |= B_VALID;
+        log_write_data(bp);
+        brelse(bp);
+    }
+    pg->dirty = 0;
+}
+
+/*
+ * Return the page of regular file ip holding offset off, referenced,
+ * with the n bytes from off on read in.  They must not cross the end
+ * of the page, and ip must not keep its data inline.  The caller
+ * copies from the page and pput()s it; ip may be unlocked meanwhile.
+ * Caller must hold ip->lock.
+ */
+struct page*
+ipage(struct inode* ip, size_t off, size_t n)
+{
+    return getpage(ip, off / PGSIZE, PAGE_BLOCKS(off % PGSIZE, n));
+}
+
 /*
  * Read data from inode.
+ * Regular files are read through the page cache, other inodes
+ * through the buffer cache.
  * Caller must hold ip->lock.
  */
 ssize_t
@@ -547,6 +962,9 @@ readi(struct inode* ip, char* dst, size_t off, size_t n)
 {
     size_t tot, m;
     struct buf* bp;
+    struct page* pg;
+    uint32_t run[BMAP_RUN];
+    int i = 0, nrun = 0;
 
     if (ip->type == T_DEV) {
         if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -559,8 +977,27 @@ readi(struct inode* ip, char* dst, size_t off, size_t n)
     if (off + n > ip->size)
         n = ip->size - off;
 
+    if (INLINE_DATA(ip->type, ip->size)) {
+        memmove(dst, (char*)ip->addrs + off, n);
+        return n;
+    }
+    if (ip->type == T_FILE) {
+        for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+            m = min(n - tot, PGSIZE - off % PGSIZE);
+            pg = getpage(ip, off / PGSIZE, PAGE_BLOCKS(off % PGSIZE, m));
+            memmove(dst, pg->data + off % PGSIZE, m);
+            pput(pg);
+        }
+        return n;
+    }
+
     for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-        bp = bread(ip->dev, bmap(ip, off / BSIZE));
+        if (i == nrun) {
+            nrun = MIN((off + n - tot - 1) / BSIZE - off / BSIZE + 1, BMAP_RUN);
+            bmap_run(ip, off / BSIZE, nrun, run);
+            i = 0;
+        }
+        bp = bread(ip->dev, run[i++]);
         m = min(n - tot, BSIZE - off % BSIZE);
         memmove(dst, bp->data + off % BSIZE, m);
         brelse(bp);
@@ -568,8 +1005,110 @@ readi(struct inode* ip, char* dst, size_t off, size_t n)
     return n;
 }
 
+/*
+ * Called before reading n bytes at off from ip.
+ * Starts reading the blocks of the request together, and while the
+ * stream stays sequential, a window of the following blocks which
+ * doubles on each sequential read up to RA_MAX. A new batch is only
+ * started once half of the window has been consumed.
+ * Caller must hold ip->lock.
+ */
+void
+readahead(struct inode* ip, struct ra_state* ra, size_t off, size_t n)
+{
+    uint32_t bno[RA_MAX];
+    uint32_t first, last, start, end, nblk;
+    int i, j, k;
+
+    if (ip->type == T_DEV || INLINE_DATA(ip->type, ip->size) || off >= ip->size || n == 0)
+        return;
+    if (off + n > ip->size)
+        n = ip->size - off;
+
+    first = off / BSIZE;
+    last = (off + n - 1) / BSIZE;
+    nblk = (ip->size + BSIZE - 1) / BSIZE;
+
+    if (off == ra->off && ra->off) {
+        ra->win = ra->win ? MIN(ra->win * 2, RA_MAX) : RA_MIN;
+        start = MAX(first, ra->issued);
+    } else {
+        ra->win = 0;
+        start = first;
+    }
+    ra->off = off + n;
+
+    end = MIN(last + ra->win, nblk - 1);
+    end = MIN(end, start + RA_MAX - 1);
+    if (start > end || (start > last && end - start + 1 < ra->win / 2))
+        return;
+
+    k = end - start + 1;
+    bmap_run(ip, start, k, bno);
+    if (ip->type == T_FILE) {
+        // Blocks already in the page cache are not read again.
+        for (i = j = 0; i < k; i++) {
+            if (!(pvalid(ip, (start + i) / BPP) & (1 << (start + i) % BPP)))
+                bno[j++] = bno[i];
+        }
+        k = j;
+    }
+    breadahead(ip->dev, bno, k);
+    ra->issued = end + 1;
+}
+
+/*
+ * Write n bytes of regular file ip at off through the page cache.
+ * The blocks written are written back from there at once.
+ */
+static void
+writepages(struct inode* ip, char* src, size_t off, size_t n)
+{
+    size_t tot, m, po;
+    struct page* pg;
+    int mask;
+
+    for (tot = 0; tot < n; tot += m, off += m, src += m) {
+        po = off % PGSIZE;
+        m = min(n - tot, PGSIZE - po);
+        // Only blocks written in part need their old contents.
+        mask = 0;
+        if (po % BSIZE)
+            mask |= PAGE_BLOCKS(po, 1);
+        if ((po + m) % BSIZE && off + m < ip->size)
+            mask |= PAGE_BLOCKS(po + m - 1, 1);
+        pg = getpage(ip, off / PGSIZE, mask);
+        memmove(pg->data + po, src, m);
+        if ((po + m) % BSIZE && off + m >= ip->size)
+            memset(pg->data + po + m, 0, BSIZE - (po + m) % BSIZE);
+        pg->valid |= PAGE_BLOCKS(po, m);
+        pg->dirty |= PAGE_BLOCKS(po, m);
+        pflush(ip, pg);
+        pput(pg);
+    }
+}
+
+/*
+ * Move the inline data of regular file ip to its first block, before
+ * it grows past NINLINE.  addrs[] then holds block addresses again.
+ */
+static void
+iuninline(struct inode* ip)
+{
+    char data[NINLINE];
+    uint32_t size = ip->size;
+
+    memmove(data, ip->addrs, size);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->size = 0;
+    writepages(ip, data, 0, size);
+    ip->size = size;
+}
+
 /*
  * Write data to inode.
+ * Small regular files are written inline, larger ones into the
+ * page cache, and the blocks written are then written back from there.
  * Caller must hold ip->lock.
  */
 ssize_t
@@ -588,15 +1127,35 @@ writei(struct inode* ip, char* src, size_t off, size_t n)
         return -1;
     if (off + n > MAXFILE * BSIZE)
         return -1;
+    if (n == 0)
+        return 0;
+
+    if (INLINE_DATA(ip->type, MAX(off + n, ip->size))) {
+        memmove((char*)ip->addrs + off, src, n);
+        ip->size = MAX(off + n, ip->size);
+        iupdate(ip);
+        return n;
+    }
+    if (ip->type == T_FILE) {
+        if (ip->size > 0 && INLINE_DATA(ip->type, ip->size))
+            iuninline(ip);
+        writepages(ip, src, off, n);
+        off += n;
+        goto out;
+    }
 
     for (tot = 0; tot < n; tot += m, off += m, src += m) {
         bp = bread(ip->dev, bmap(ip, off / BSIZE));
         m = min(n - tot, BSIZE - off % BSIZE);
         memmove(bp->data + off % BSIZE, src, m);
-        log_write(bp);
+        if (ip->type == T_FILE)
+            log_write_data(bp);
+        else
+            log_write(bp);
         brelse(bp);
     }
 
+out:
     if (n > 0 && off > ip->size) {
         ip->size = off;
         iupdate(ip);
@@ -612,6 +1171,520 @@ namecmp(const char* s, const char* t)
     return strncmp(s, t, DIRSIZ);
 }
 
+/* Directory entry cache.
+ *
+ * The dcache maps (directory, name) to the inode number and offset
+ * of the matching dirent, or records that there is none, so that
+ * dirlookup() of a name seen before reads no directory blocks.
+ * Entries of a directory change only while it is locked: dirlookup()
+ * fills them in, dirlink() and dirunlink() update them, and iput()
+ * drops those of a directory it frees.  Entries are hashed, and the
+ * least recently used one is recycled.
+ */
+
+#define NDCACHE      256
+#define DCACHE_NHASH 64
+
+struct dentry {
+    uint32_t dev;
+    uint32_t parent;        // Inode number of the directory, 0 if unused
+    char name[DIRSIZ];
+    uint32_t inum;          // 0 if the name is absent
+    uint32_t off;           // Offset of its dirent
+    struct dentry* hnext;   // Hash chain
+    struct dentry* next;    // LRU list
+    struct dentry* prev;
+};
+
+struct {
+    struct spinlock lock;
+    struct dentry dentry[NDCACHE];
+    struct dentry* hash[DCACHE_NHASH];
+    struct dentry* mru;     /* Circular LRU list; mru->prev is least recent. */
+    uint64_t hit;
+    uint64_t neghit;
+    uint64_t miss;
+} dcache;
+
+static struct dentry**
+dhash(uint32_t dev, uint32_t parent, const char* name)
+{
+    uint32_t h = parent ^ (dev << 24);
+    int i;
+
+    for (i = 0; i < DIRSIZ && name[i]; i++)
+        h = h * 31 + name[i];
+    h *= 2654435761u;
+    return &dcache.hash[(h >> 8) & (DCACHE_NHASH - 1)];
+}
+
+/* Move e to the most recently used end, or the least if !recent. Caller holds dcache.lock. */
+static void
+dcache_touch(struct dentry* e, int recent)
+{
+    if (e->next) {
+        if (e->next == e)
+            return;
+        e->next->prev = e->prev;
+        e->prev->next = e->next;
+        if (dcache.mru == e)
+            dcache.mru = e->next;
+    }
+    if (dcache.mru == 0) {
+        e->next = e->prev = e;
+    } else {
+        e->next = dcache.mru;
+        e->prev = dcache.mru->prev;
+        dcache.mru->prev->next = e;
+        dcache.mru->prev = e;
+    }
+    dcache.mru = recent ? e : e->next;
+}
+
+/* Take e out of its hash chain. Caller holds dcache.lock. */
+static void
+dcache_unhash(struct dentry* e)
+{
+    struct dentry** pp;
+
+    for (pp = dhash(e->dev, e->parent, e->name); *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+    e->parent = 0;
+}
+
+static struct dentry*
+dcache_find(uint32_t dev, uint32_t parent, const char* name)
+{
+    struct dentry* e;
+
+    for (e = *dhash(dev, parent, name); e; e = e->hnext) {
+        if (e->dev == dev && e->parent == parent && namecmp(e->name, name) == 0)
+            return e;
+    }
+    return 0;
+}
+
+/*
+ * Look name up in directory dp.  Return -1 if it is not cached,
+ * 0 if it is known to be absent, else its inode number, with the
+ * offset of its dirent in *poff.
+ */
+static int
+dcache_lookup(struct inode* dp, const char* name, uint32_t* poff)
+{
+    struct dentry* e;
+    int inum = -1;
+
+    acquire(&dcache.lock);
+    if ((e = dcache_find(dp->dev, dp->inum, name)) != 0) {
+        inum = e->inum;
+        *poff = e->off;
+        dcache_touch(e, 1);
+        if (inum)
+            dcache.hit++;
+        else
+            dcache.neghit++;
+    } else {
+        dcache.miss++;
+    }
+    release(&dcache.lock);
+    return inum;
+}
+
+/* Record that name in dp is inode inum, at offset off, or absent if inum is 0. */
+static void
+dcache_enter(struct inode* dp, const char* name, uint32_t inum, uint32_t off)
+{
+    struct dentry* e, ** pp;
+
+    acquire(&dcache.lock);
+    if ((e = dcache_find(dp->dev, dp->inum, name)) == 0) {
+        e = dcache.mru->prev;
+        if (e->parent)
+            dcache_unhash(e);
+        e->dev = dp->dev;
+        e->parent = dp->inum;
+        strncpy(e->name, name, DIRSIZ);
+        pp = dhash(e->dev, e->parent, e->name);
+        e->hnext = *pp;
+        *pp = e;
+    }
+    e->inum = inum;
+    e->off = off;
+    dcache_touch(e, 1);
+    release(&dcache.lock);
+}
+
+/* Drop the entries of directory inum, which is being freed. */
+static void
+dcache_purge(uint32_t dev, uint32_t inum)
+{
+    struct dentry* e;
+
+    acquire(&dcache.lock);
+    for (e = dcache.dentry; e < dcache.dentry + NDCACHE; e++) {
+        if (e->parent == inum && e->dev == dev) {
+            dcache_unhash(e);
+            dcache_touch(e, 0);
+        }
+    }
+    release(&dcache.lock);
+}
+
+static void
+dcache_init()
+{
+    struct dentry* e;
+
+    initlock(&dcache.lock, "dcache");
+    for (e = dcache.dentry; e < dcache.dentry + NDCACHE; e++)
+        dcache_touch(e, 0);
+}
+
+/* Forget the cached entries of directory dp, so that lookups read it (for tests). */
+void
+dcache_drop(struct inode* dp)
+{
+    dcache_purge(dp->dev, dp->inum);
+}
+
+/* Report directory entry cache statistics. */
+void
+dstat(struct dstat* st)
+{
+    acquire(&dcache.lock);
+    st->hit = dcache.hit;
+    st->neghit = dcache.neghit;
+    st->miss = dcache.miss;
+    release(&dcache.lock);
+}
+
+/* Indexed directories.
+ *
+ * A directory is a flat array of dirents until it fills its first
+ * block; the next dirlink() moves those entries to a leaf and makes
+ * block 0 the root of a hash tree (see struct dxhdr).  A name is
+ * looked up by following, in each index node, the last entry whose
+ * hash is not above the name's, and scanning the one leaf reached.
+ * A full leaf is split at its median hash, never between equal
+ * hashes, and a full index node in half; when the root is full, its
+ * entries move down to a new node and the tree grows a level, up to
+ * DX_MAXLEVEL.  Leaves are never merged.  Splits move dirents, so
+ * they drop the directory's dcache entries.
+ *
+ * Multi-block flat directories made by older file systems stay flat.
+ */
+
+/* The index nodes walked from the root down to a leaf. */
+struct dxpath {
+    int n;
+    uint32_t block[DX_MAXLEVEL];
+    int idx[DX_MAXLEVEL];       // Entry followed
+    int count[DX_MAXLEVEL];     // Entries in use
+};
+
+/* Return whether directory dp is indexed. */
+static int
+dx_indexed(struct inode* dp)
+{
+    struct buf* bp;
+    struct dxhdr* h;
+    int r;
+
+    if (dp->size < BSIZE)
+        return 0;
+    bp = bread(dp->dev, bmap(dp, 0));
+    h = (struct dxhdr*)bp->data;
+    r = h->inum == 0 && h->magic == DX_MAGIC;
+    brelse(bp);
+    return r;
+}
+
+/* Return the leaf of indexed directory dp for hash, recording the path in *p. */
+static uint32_t
+dx_find(struct inode* dp, uint32_t hash, struct dxpath* p)
+{
+    struct buf* bp;
+    struct dxhdr* h;
+    struct dxentry* e;
+    uint32_t blk = 0;
+    int lo, hi, mid, level;
+
+    p->n = 0;
+    do {
+        bp = bread(dp->dev, bmap(dp, blk));
+        h = (struct dxhdr*)bp->data;
+        e = (struct dxentry*)(h + 1);
+        if (h->magic != DX_MAGIC || h->count == 0 || p->n == DX_MAXLEVEL)
+            panic("dx_find: bad index node");
+        for (lo = 0, hi = h->count - 1; lo < hi; ) {
+            mid = (lo + hi + 1) / 2;
+            if (e[mid].hash <= hash)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        p->block[p->n] = blk;
+        p->idx[p->n] = lo;
+        p->count[p->n++] = h->count;
+        blk = e[lo].block;
+        level = h->level;
+        brelse(bp);
+    } while (level > 0);
+    return blk;
+}
+
+/*
+ * Look name up in indexed directory dp.  Return its inode number,
+ * with the offset of its dirent in *poff, or 0 if it is absent.
+ */
+static uint32_t
+dx_lookup(struct inode* dp, char* name, uint32_t* poff)
+{
+    struct dxpath p;
+    struct buf* bp;
+    struct dirent* de;
+    uint32_t leaf, inum = 0;
+    int i;
+
+    leaf = dx_find(dp, dx_hash(name), &p);
+    bp = bread(dp->dev, bmap(dp, leaf));
+    de = (struct dirent*)bp->data;
+    for (i = 0; i < DPB; i++) {
+        if (de[i].inum && namecmp(name, de[i].name) == 0) {
+            inum = de[i].inum;
+            *poff = leaf * BSIZE + i * sizeof(*de);
+            break;
+        }
+    }
+    brelse(bp);
+    return inum;
+}
+
+/* Append a block to directory dp, returning its number and a buffer of it. */
+static uint32_t
+dx_newblock(struct inode* dp, struct buf** bpp)
+{
+    uint32_t blk = dp->size / BSIZE;
+
+    *bpp = bread(dp->dev, bmap(dp, blk));   // bmap() zeroes a new block.
+    dp->size += BSIZE;
+    iupdate(dp);
+    return blk;
+}
+
+/* Turn flat directory dp, whose one block is full, into a hash tree. */
+static void
+dx_convert(struct inode* dp)
+{
+    struct buf* bp, * lbp;
+    struct dxhdr* h;
+    struct dxentry* e;
+    uint32_t leaf;
+
+    leaf = dx_newblock(dp, &lbp);
+    bp = bread(dp->dev, bmap(dp, 0));
+    memmove(lbp->data, bp->data, BSIZE);
+    memset(bp->data, 0, BSIZE);
+    h = (struct dxhdr*)bp->data;
+    h->magic = DX_MAGIC;
+    h->level = 0;
+    h->count = 1;
+    e = (struct dxentry*)(h + 1);
+    e[0].hash = 0;
+    e[0].block = leaf;
+    log_write(lbp);
+    log_write(bp);
+    brelse(bp);
+    brelse(lbp);
+    dcache_purge(dp->dev, dp->inum);
+}
+
+/* Return whether one more entry fits in the index nodes along p. */
+static int
+dx_room(struct dxpath* p)
+{
+    int lvl;
+
+    for (lvl = p->n - 1; lvl >= 0 && p->count[lvl] == DX_NENTRY; lvl--)
+        ;
+    return lvl >= 0 || p->n < DX_MAXLEVEL;
+}
+
+/*
+ * Insert an entry for block blk, whose least hash is hash, into the
+ * index node at level lvl of p, after the entry p followed there.
+ * dx_room() must have said it fits.
+ */
+static void
+dx_insert(struct inode* dp, struct dxpath* p, int lvl, uint32_t hash, uint32_t blk)
+{
+    struct buf* bp, * nbp;
+    struct dxhdr* h, * nh;
+    struct dxentry* e, * ne;
+    uint32_t nb;
+    int pos, half, i;
+
+    bp = bread(dp->dev, bmap(dp, p->block[lvl]));
+    h = (struct dxhdr*)bp->data;
+    e = (struct dxentry*)(h + 1);
+    pos = p->idx[lvl] + 1;
+
+    if (h->count == DX_NENTRY && lvl == 0) {
+        // Move the root's entries down to a new node, one level deeper.
+        nb = dx_newblock(dp, &nbp);
+        memmove(nbp->data, bp->data, BSIZE);
+        memset(e, 0, DX_NENTRY * sizeof(*e));
+        h->level++;
+        h->count = 1;
+        e[0].block = nb;
+        log_write(nbp);
+        log_write(bp);
+        brelse(nbp);
+        brelse(bp);
+        for (i = p->n; i > 0; i--) {
+            p->block[i] = p->block[i - 1];
+            p->idx[i] = p->idx[i - 1];
+            p->count[i] = p->count[i - 1];
+        }
+        p->block[1] = nb;
+        p->idx[0] = 0;
+        p->count[0] = 1;
+        p->n++;
+        dx_insert(dp, p, 1, hash, blk);
+        return;
+    }
+
+    if (h->count == DX_NENTRY) {
+        // Split the node in half, and add the new half to the parent.
+        nb = dx_newblock(dp, &nbp);
+        nh = (struct dxhdr*)nbp->data;
+        ne = (struct dxentry*)(nh + 1);
+        half = DX_NENTRY / 2;
+        nh->magic = DX_MAGIC;
+        nh->level = h->level;
+        nh->count = h->count - half;
+        memmove(ne, e + half, nh->count * sizeof(*e));
+        memset(e + half, 0, nh->count * sizeof(*e));
+        h->count = half;
+        if (pos > half) {
+            h = nh;
+            e = ne;
+            pos -= half;
+        }
+        memmove(e + pos + 1, e + pos, (h->count - pos) * sizeof(*e));
+        e[pos].hash = hash;
+        e[pos].block = blk;
+        h->count++;
+        hash = ne[0].hash;
+        log_write(nbp);
+        log_write(bp);
+        brelse(nbp);
+        brelse(bp);
+        dx_insert(dp, p, lvl - 1, hash, nb);
+        return;
+    }
+
+    memmove(e + pos + 1, e + pos, (h->count - pos) * sizeof(*e));
+    e[pos].hash = hash;
+    e[pos].block = blk;
+    h->count++;
+    log_write(bp);
+    brelse(bp);
+}
+
+/*
+ * Split full leaf bp of dp, moving the entries whose hash is at
+ * least *sep to a new leaf *nb.  Return -1 if they all share a hash.
+ */
+static int
+dx_split_leaf(struct inode* dp, struct buf* bp, uint32_t* sep, uint32_t* nb)
+{
+    struct dirent* de = (struct dirent*)bp->data, * nde;
+    uint32_t hv[DPB];
+    struct buf* nbp;
+    int ord[DPB], i, j, k;
+
+    // Order the entries by hash.
+    for (i = 0; i < DPB; i++) {
+        hv[i] = dx_hash(de[i].name);
+        for (j = i; j > 0 && hv[ord[j - 1]] > hv[i]; j--)
+            ord[j] = ord[j - 1];
+        ord[j] = i;
+    }
+    // Split at the middle, but not between equal hashes.
+    for (k = DPB / 2; k < DPB && hv[ord[k]] == hv[ord[k - 1]]; k++)
+        ;
+    if (k == DPB) {
+        for (k = DPB / 2; k > 0 && hv[ord[k]] == hv[ord[k - 1]]; k--)
+            ;
+    }
+    if (k == 0)
+        return -1;
+
+    *sep = hv[ord[k]];
+    *nb = dx_newblock(dp, &nbp);
+    nde = (struct dirent*)nbp->data;
+    for (i = j = 0; i < DPB; i++) {
+        if (hv[i] >= *sep) {
+            nde[j++] = de[i];
+            memset(&de[i], 0, sizeof(de[i]));
+        }
+    }
+    log_write(nbp);
+    log_write(bp);
+    brelse(nbp);
+    dcache_purge(dp->dev, dp->inum);
+    return 0;
+}
+
+/*
+ * Add (name, inum) to indexed directory dp, setting *poff to the
+ * offset of its dirent.  Return -1 if the index is full.
+ *
+ * With DX_MAXLEVEL 2, at most one index node is split or the root
+ * grown, so this logs at most the leaf and its new half, the root,
+ * two more index nodes, the inode, and the bitmap and indirect
+ * blocks of three new blocks: 13 blocks, within MAXOPBLOCKS with
+ * what create() logs for a new directory.
+ */
+static int
+dx_add(struct inode* dp, char* name, uint32_t inum, uint32_t* poff)
+{
+    struct dxpath p;
+    struct buf* bp;
+    struct dirent* de;
+    uint32_t hash = dx_hash(name), leaf, sep, nb;
+    int i;
+
+    leaf = dx_find(dp, hash, &p);
+    bp = bread(dp->dev, bmap(dp, leaf));
+    de = (struct dirent*)bp->data;
+    for (i = 0; i < DPB && de[i].inum; i++)
+        ;
+    if (i == DPB) {
+        if (!dx_room(&p) || dx_split_leaf(dp, bp, &sep, &nb) < 0) {
+            brelse(bp);
+            return -1;
+        }
+        brelse(bp);
+        dx_insert(dp, &p, p.n - 1, sep, nb);
+        if (hash >= sep)
+            leaf = nb;
+        bp = bread(dp->dev, bmap(dp, leaf));
+        de = (struct dirent*)bp->data;
+        for (i = 0; de[i].inum; i++)
+            ;
+    }
+    strncpy(de[i].name, name, DIRSIZ);
+    de[i].inum = inum;
+    log_write(bp);
+    brelse(bp);
+    *poff = leaf * BSIZE + i * sizeof(*de);
+    return 0;
+}
+
 /*
  * Look for a directory entry in a directory.
  * If found, set *poff to byte offset of entry.
@@ -619,12 +1692,31 @@ namecmp(const char* s, const char* t)
 struct inode*
     dirlookup(struct inode* dp, char* name, size_t* poff)
 {
-    size_t off, inum;
+    uint32_t off;
+    int inum;
     struct dirent de;
 
     if (dp->type != T_DIR)
         panic("dirlookup not DIR");
 
+    if ((inum = dcache_lookup(dp, name, &off)) >= 0) {
+        if (inum == 0)
+            return 0;
+        if (poff)
+            *poff = off;
+        return iget(dp->dev, inum);
+    }
+
+    if (dx_indexed(dp)) {
+        inum = dx_lookup(dp, name, &off);
+        dcache_enter(dp, name, inum, off);
+        if (inum == 0)
+            return 0;
+        if (poff)
+            *poff = off;
+        return iget(dp->dev, inum);
+    }
+
     for (off = 0; off < dp->size; off += sizeof(de)) {
         if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
             panic("dirlookup read");
@@ -635,17 +1727,87 @@ struct inode*
             if (poff)
                 *poff = off;
             inum = de.inum;
+            dcache_enter(dp, name, inum, off);
             return iget(dp->dev, inum);
         }
     }
+    dcache_enter(dp, name, 0, 0);
     return 0;
 }
 
+/* Return the DT_* type of inode inum, for a getdents64 type hint. */
+static int
+dirent_type(uint32_t dev, uint32_t inum)
+{
+    struct buf* bp;
+    int type;
+
+    bp = bread(dev, IBLOCK(inum, getmount(dev)->sb));
+    type = ((struct dinode*)bp->data + inum % IPB)->type;
+    brelse(bp);
+    switch (type) {
+    case T_DIR:
+        return DT_DIR;
+    case T_FILE:
+        return DT_REG;
+    case T_DEV:
+        return DT_CHR;
+    }
+    return DT_UNKNOWN;
+}
+
+/*
+ * Fill dst with up to n bytes of linux_dirent64 records for the
+ * entries of directory dp from offset *poff on, reading each block
+ * once, and advance *poff past them.  Return the bytes filled.
+ * Caller must hold dp->lock.
+ */
+ssize_t
+dirread(struct inode* dp, char* dst, size_t* poff, size_t n)
+{
+    struct linux_dirent64* d;
+    struct dirent* de;
+    struct buf* bp;
+    size_t off, tot = 0;
+    int len, reclen;
+
+    if (dp->type != T_DIR)
+        panic("dirread not DIR");
+
+    off = ROUNDDOWN(*poff, sizeof(*de));
+    while (off < dp->size) {
+        bp = bread(dp->dev, bmap(dp, off / BSIZE));
+        de = (struct dirent*)bp->data + off % BSIZE / sizeof(*de);
+        for (; de < (struct dirent*)(bp->data + BSIZE) && off < dp->size; de++, off += sizeof(*de)) {
+            if (de->inum == 0)
+                continue;
+            len = strnlen(de->name, DIRSIZ);
+            reclen = ROUNDUP(offsetof(struct linux_dirent64, d_name) + len + 1, 8);
+            if (tot + reclen > n) {
+                brelse(bp);
+                goto out;
+            }
+            d = (struct linux_dirent64*)(dst + tot);
+            d->d_ino = de->inum;
+            d->d_off = off + sizeof(*de);
+            d->d_reclen = reclen;
+            d->d_type = dirent_type(dp->dev, de->inum);
+            memmove(d->d_name, de->name, len);
+            d->d_name[len] = 0;
+            tot += reclen;
+        }
+        brelse(bp);
+    }
+out:
+    *poff = off;
+    return tot;
+}
+
 /* Write a new directory entry (name, inum) into the directory dp. */
 int
 dirlink(struct inode* dp, char* name, uint32_t inum)
 {
-    ssize_t off;
+    uint32_t off;
     struct dirent de;
     struct inode* ip;
 
@@ -655,18 +1817,30 @@ dirlink(struct inode* dp, char* name, uint32_t inum)
         return -1;
     }
 
-    /* Look for an empty dirent. */
-    for (off = 0; off < dp->size; off += sizeof(de)) {
-        if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-            panic("dirlink read");
-        if (de.inum == 0)
-            break;
+    if (!dx_indexed(dp)) {
+        /* Look for an empty dirent. */
+        for (off = 0; off < dp->size; off += sizeof(de)) {
+            if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+                panic("dirlink read");
+            if (de.inum == 0)
+                break;
+        }
+
+        if (off < dp->size || dp->size != BSIZE) {
+            strncpy(de.name, name, DIRSIZ);
+            de.inum = inum;
+            if (writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+                panic("dirlink");
+            dcache_enter(dp, name, inum, off);
+            return 0;
+        }
+        /* The first block is full: index the directory. */
+        dx_convert(dp);
     }
 
-    strncpy(de.name, name, DIRSIZ);
-    de.inum = inum;
-    if (writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-        panic("dirlink");
+    if (dx_add(dp, name, inum, &off) < 0)
+        return -1;
+    dcache_enter(dp, name, inum, off);
 
     return 0;
 }
@@ -778,25 +1952,25 @@ struct inode*
 int
 dirunlink(struct inode* dp, char* name, uint32_t inum)
 {
-    ssize_t off;
+    size_t off;
     struct dirent d;
     struct inode* ip;
 
-    if ((ip = dirlookup(dp, name, 0)) == 0) {
+    if ((ip = dirlookup(dp, name, &off)) == 0) {
         panic("no corresponding name");
     }
+    iput(ip);
 
-    for (off = 0; off < dp->size; off += sizeof(d)) {
-        if (readi(dp, (char*)&d, off, sizeof(d)) != sizeof(d))
-            panic("dirlink read");
-        if (d.inum == inum)
-            break;
-    }
+    if (readi(dp, (char*)&d, off, sizeof(d)) != sizeof(d))
+        panic("dirlink read");
+    if (d.inum != inum)
+        panic("dirunlink: %s is not inode %d", name, inum);
 
     memset(d.name, 0, DIRSIZ);
     d.inum = 0;
     if (writei(dp, (char*)&d, off, sizeof(d)) != sizeof(d))
         panic("dirunlink");
+    dcache_enter(dp, name, 0, 0);
 
     return 0;
 }
@@ -2,6 +2,10 @@
 #include "console.h"
 #include "file.h"
 #include "string.h"
+#include "buf.h"
+#include "blk.h"
+#include "log.h"
+#include "pcache.h"
 #include <elf.h>
 #define TEST_FUNC(name) \
   do { \
@@ -166,6 +170,568 @@ int test_rmdir()
     }
     return dirunlink(thisproc()->cwd, "dir", dir->inum);
 }
+
+/* Open path for the tests, creating it for writing if create_it. */
+static struct file* bench_open(char* path, int create_it)
+{
+    struct file* fp = filealloc();
+
+    fp->type = FD_INODE;
+    fp->ref = 1;
+    fp->off = 0;
+    if (create_it) {
+        fp->writable = 1;
+        begin_op();
+        fp->ip = create(path, T_FILE, 0, 0);
+        end_op();
+        if (fp->ip)
+            iunlock(fp->ip);
+    } else {
+        fp->readable = 1;
+        fp->ip = namei(path);
+    }
+    if (fp->ip == 0) {
+        fp->ref = 0;
+        return 0;
+    }
+    return fp;
+}
+
+/*
+ * Unlink a file or an empty directory a test made in the current
+ * directory and free it, so the image keeps its blocks.
+ */
+static int bench_remove(char* path)
+{
+    struct inode* dp = thisproc()->cwd, * ip;
+    int r;
+
+    begin_op();
+    if ((ip = namei(path)) == 0) {
+        end_op();
+        return -1;
+    }
+    ilock(dp);
+    ilock(ip);
+    r = dirunlink(dp, path, ip->inum);
+    if (ip->type == T_DIR) {
+        dp->nlink--;    // for ".."
+        iupdate(dp);
+    }
+    iunlock(dp);
+    ip->nlink--;
+    iupdate(ip);
+    iunlockput(ip);
+    end_op();
+    return r;
+}
+
+/*
+ * Link TEST_DIR_N names in a new directory, so that it is indexed,
+ * look each of them up, then unlink them all and remove it.  The
+ * directory's dcache entries are dropped first, so the lookups go
+ * through the index.
+ */
+#define TEST_DIR_N 300
+
+static void test_dir_name(char* name, int i)
+{
+    char* p = name + sizeof("entry") - 1;
+
+    memmove(name, "entry", sizeof("entry") - 1);
+    for (int n = i; n >= 10; n /= 10)
+        p++;
+    p[1] = 0;
+    do {
+        *p-- = '0' + i % 10;
+        i /= 10;
+    } while (i);
+}
+
+int test_large_dir()
+{
+    struct inode* dp, * ip;
+    char name[DIRSIZ];
+    int i, r = 0;
+
+    begin_op();
+    dp = create("bigdir", T_DIR, 0, 0);
+    end_op();
+    if (dp == 0)
+        return -1;
+    for (i = 0; i < TEST_DIR_N && r == 0; i++) {
+        test_dir_name(name, i);
+        begin_op();
+        r = dirlink(dp, name, dp->inum);
+        end_op();
+    }
+    dcache_drop(dp);
+    for (i = 0; i < TEST_DIR_N && r == 0; i++) {
+        test_dir_name(name, i);
+        if ((ip = dirlookup(dp, name, 0)) == 0 || ip->inum != dp->inum)
+            r = -1;
+        if (ip)
+            iput(ip);
+    }
+    cprintf("bigdir: %d entries in %d blocks\n", TEST_DIR_N, dp->size / BSIZE);
+    for (i = 0; i < TEST_DIR_N && r == 0; i++) {
+        test_dir_name(name, i);
+        begin_op();
+        if (dirunlink(dp, name, dp->inum) < 0)
+            r = -1;
+        end_op();
+        dcache_drop(dp);
+        if ((ip = dirlookup(dp, name, 0)) != 0) {
+            iput(ip);
+            r = -1;
+        }
+    }
+    iunlockput(dp);
+    if (bench_remove("bigdir") < 0)
+        r = -1;
+    return r;
+}
+
+/*
+ * Write TEST_PAGE_SIZE bytes in chunks that straddle blocks and pages,
+ * overwrite a range across a page boundary, and check the contents
+ * both from the page cache and read back from the buffer cache.
+ */
+#define TEST_PAGE_SIZE  (3 * PGSIZE)
+#define TEST_PAGE_CHUNK 1000
+
+static char test_page_byte(int off)
+{
+    return off >= PGSIZE - 300 && off < PGSIZE + 400 ? 'z' : 'a' + off % 23;
+}
+
+static int test_page_check(struct inode* ip)
+{
+    static char buf[TEST_PAGE_SIZE];
+
+    if (readi(ip, buf, 0, TEST_PAGE_SIZE) != TEST_PAGE_SIZE)
+        return -1;
+    for (int i = 0; i < TEST_PAGE_SIZE; i++) {
+        if (buf[i] != test_page_byte(i))
+            return -1;
+    }
+    return 0;
+}
+
+/* Write in a transaction of its own, as filewrite() does. */
+static int test_page_write(struct inode* ip, char* buf, int off, int n)
+{
+    int r;
+
+    begin_op();
+    ilock(ip);
+    r = writei(ip, buf, off, n);
+    iunlock(ip);
+    end_op();
+    return r == n ? 0 : -1;
+}
+
+int test_page_cache()
+{
+    static char buf[TEST_PAGE_CHUNK];
+    struct inode* ip;
+    int off, m, r;
+
+    begin_op();
+    ip = create("pagec", T_FILE, 0, 0);
+    end_op();
+    if (ip == 0)
+        return -1;
+    iunlock(ip);
+
+    for (off = 0, r = 0; off < TEST_PAGE_SIZE && r == 0; off += m) {
+        m = MIN(TEST_PAGE_CHUNK, TEST_PAGE_SIZE - off);
+        for (int i = 0; i < m; i++)
+            buf[i] = 'a' + (off + i) % 23;
+        r = test_page_write(ip, buf, off, m);
+    }
+    memset(buf, 'z', 700);
+    if (r == 0)
+        r = test_page_write(ip, buf, PGSIZE - 300, 700);
+
+    ilock(ip);
+    if (r == 0)
+        r = test_page_check(ip);
+    pdrop(ip);
+    if (r == 0)
+        r = test_page_check(ip);
+    iunlock(ip);
+    begin_op();
+    iput(ip);
+    end_op();
+    if (bench_remove("pagec") < 0)
+        r = -1;
+    return r;
+}
+
+/*
+ * Write a file small enough to be kept inline, check that it takes
+ * no block, then grow it past NINLINE and read all of it back.
+ */
+int test_inline()
+{
+    static char buf[NINLINE + 40];
+    struct mount* m = getmount(ROOTDEV);
+    struct inode* ip;
+    uint32_t nfree;
+    int i, r = 0;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = 'a' + i % 26;
+    begin_op();
+    ip = create("inline", T_FILE, 0, 0);
+    if (ip == 0) {
+        end_op();
+        return -1;
+    }
+    nfree = m->nfree;
+    // A file left over from an earlier run would not start out inline.
+    if (ip->size != 0)
+        r = -1;
+    if (r == 0 && (writei(ip, buf, 0, NINLINE - 10) != NINLINE - 10 ||
+        writei(ip, buf + NINLINE - 10, NINLINE - 10, 10) != 10))
+        r = -1;
+    if (m->nfree != nfree || memcmp(ip->addrs, buf, NINLINE))
+        r = -1;
+    iunlock(ip);
+    end_op();
+
+    begin_op();
+    ilock(ip);
+    if (r == 0 && writei(ip, buf + NINLINE, NINLINE, 40) != 40)
+        r = -1;
+    if (m->nfree == nfree)
+        r = -1;
+    memset(buf, 0, sizeof(buf));
+    if (r == 0 && readi(ip, buf, 0, sizeof(buf)) != sizeof(buf))
+        r = -1;
+    for (i = 0; i < sizeof(buf) && r == 0; i++) {
+        if (buf[i] != 'a' + i % 26)
+            r = -1;
+    }
+    iunlockput(ip);
+    end_op();
+    if (bench_remove("inline") < 0)
+        r = -1;
+    return r;
+}
+
+/*
+ * Write TEST_IOV_N buffers with one filewritev(), which should take a
+ * single operation, then read them back scattered, at an offset.
+ */
+#define TEST_IOV_N  16
+#define TEST_IOV_LEN 37
+
+int test_iovec()
+{
+    static char buf[TEST_IOV_N][TEST_IOV_LEN];
+    struct iovec iov[TEST_IOV_N];
+    struct logstat l0, l1;
+    struct file* fp;
+    size_t off;
+    int i, j, r = 0;
+
+    if ((fp = bench_open("iovec", 1)) == 0)
+        return -1;
+    fp->readable = 1;
+
+    for (i = 0; i < TEST_IOV_N; i++) {
+        memset(buf[i], 'A' + i, TEST_IOV_LEN);
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = TEST_IOV_LEN;
+    }
+    logstat(&l0);
+    if (filewritev(fp, iov, TEST_IOV_N, &fp->off) != sizeof(buf))
+        r = -1;
+    logstat(&l1);
+    if (l1.nop - l0.nop != 1)
+        r = -1;
+
+    // Read all but the first buffer back, one byte short of the end.
+    memset(buf, 0, sizeof(buf));
+    off = TEST_IOV_LEN;
+    iov[TEST_IOV_N - 2].iov_len = TEST_IOV_LEN - 1;
+    if (r == 0 && filereadv(fp, iov, TEST_IOV_N - 1, &off) != sizeof(buf) - TEST_IOV_LEN - 1)
+        r = -1;
+    for (i = 0; i < TEST_IOV_N - 1 && r == 0; i++) {
+        for (j = 0; j < TEST_IOV_LEN; j++) {
+            if (buf[i][j] != (i == TEST_IOV_N - 2 && j == TEST_IOV_LEN - 1 ? 0 : 'B' + i))
+                r = -1;
+        }
+    }
+    if (fp->off != sizeof(buf))
+        r = -1;
+    fileclose(fp);
+    if (bench_remove("iovec") < 0)
+        r = -1;
+    return r;
+}
+
+/*
+ * Check the allocator's summaries against the block bitmap and the
+ * inode table: the free counts, that nothing below each hint is free,
+ * and that the inode bitmap marks exactly the inodes in use.
+ */
+static int test_alloc_check(struct mount* m)
+{
+    struct buf* bp;
+    struct dinode* dip;
+    uint32_t g, bi, end, inum, nfree, tot = 0, nifree = 0;
+    int used, r = 0;
+
+    for (g = 0; g < m->nbmap; g++) {
+        bp = bread(m->dev, m->sb.bmapstart + g);
+        end = MIN(m->sb.size - g * BPB, BPB);
+        for (bi = 0, nfree = 0; bi < end; bi++) {
+            if (bp->data[bi / 8] & (1 << (bi % 8)))
+                continue;
+            nfree++;
+            if (bi < m->sum[g].first)
+                r = -1;
+        }
+        brelse(bp);
+        if (nfree != m->sum[g].nfree)
+            r = -1;
+        tot += nfree;
+    }
+    if (tot != m->nfree)
+        r = -1;
+
+    for (inum = 1; inum < m->sb.ninodes; inum++) {
+        bp = bread(m->dev, IBLOCK(inum, m->sb));
+        dip = (struct dinode*)bp->data + inum % IPB;
+        used = dip->type != 0;
+        brelse(bp);
+        if (used != ((m->imap[inum / 64] >> (inum % 64)) & 1))
+            r = -1;
+        if (!used && inum < m->ifirst)
+            r = -1;
+        nifree += !used;
+    }
+    if (nifree != m->nifree)
+        r = -1;
+    return r;
+}
+
+/*
+ * Write a file of TEST_ALLOC_N blocks and check they were placed
+ * contiguously, then remove it and check everything was given back.
+ */
+#define TEST_ALLOC_N NDIRECT
+
+int test_alloc()
+{
+    static char buf[TEST_ALLOC_N * BSIZE];
+    struct mount* m = getmount(ROOTDEV);
+    uint32_t nfree, nifree;
+    struct file* fp;
+    int i, r = 0;
+
+    if ((fp = bench_open("alloc", 1)) == 0)
+        return -1;
+    nfree = m->nfree;
+    nifree = m->nifree;
+    memset(buf, 'a', sizeof(buf));
+    if (filewrite(fp, buf, sizeof(buf)) != sizeof(buf))
+        r = -1;
+    ilock(fp->ip);
+    for (i = 1; i < TEST_ALLOC_N && r == 0; i++) {
+        if (fp->ip->addrs[i] != fp->ip->addrs[0] + i)
+            r = -1;
+    }
+    iunlock(fp->ip);
+    if (r == 0)
+        r = test_alloc_check(m);
+    fileclose(fp);
+
+    if (bench_remove("alloc") < 0 || test_alloc_check(m) < 0)
+        r = -1;
+    if (m->nfree != nfree || m->nifree != nifree + 1)
+        r = -1;
+    return r;
+}
+
+/* Milliseconds in t timer ticks, at least 1. */
+static uint64_t bench_ms(uint64_t t)
+{
+    uint64_t f;
+
+    asm volatile ("mrs %[freq], cntfrq_el0" : [freq] "=r"(f));
+    return MAX(t * 1000 / f, 1);
+}
+
+/*
+ * Small-write benchmark: append BENCH_SMALL_N writes of BENCH_SMALL_SIZE
+ * bytes, then sync, and report the rate and how many commits it took.
+ */
+#define BENCH_SMALL_N       256
+#define BENCH_SMALL_SIZE    64
+
+int bench_small_write()
+{
+    char buf[BENCH_SMALL_SIZE];
+    struct logstat l0, l1;
+    struct file* fp;
+    uint64_t t;
+
+    memset(buf, 'x', sizeof(buf));
+    if ((fp = bench_open("smallw", 1)) == 0)
+        return -1;
+
+    logstat(&l0);
+    t = timestamp();
+    for (int i = 0; i < BENCH_SMALL_N; i++) {
+        if (filewrite(fp, buf, sizeof(buf)) != sizeof(buf)) {
+            fileclose(fp);
+            return -1;
+        }
+    }
+    log_sync();
+    t = timestamp() - t;
+    logstat(&l1);
+    fileclose(fp);
+    if (bench_remove("smallw") < 0)
+        return -1;
+
+    t = bench_ms(t);
+    cprintf("small writes: %d x %dB in %lld ms, %lld writes/s, %lld commits of %lld blocks\n",
+        BENCH_SMALL_N, BENCH_SMALL_SIZE, t, BENCH_SMALL_N * 1000 / t,
+        l1.ncommit - l0.ncommit, l1.nblock - l0.nblock);
+    return 0;
+}
+
+/*
+ * Large-write benchmark: write a BENCH_LARGE_SIZE file sequentially in
+ * BENCH_LARGE_CHUNK writes, then sync, and report the throughput and
+ * how much went through the log.
+ */
+#define BENCH_LARGE_SIZE    (64 * 1024)
+#define BENCH_LARGE_CHUNK   4096
+
+int bench_large_write()
+{
+    static char buf[BENCH_LARGE_CHUNK];
+    struct logstat l0, l1;
+    struct file* fp;
+    uint64_t t;
+
+    memset(buf, 'y', sizeof(buf));
+    if ((fp = bench_open("largew", 1)) == 0)
+        return -1;
+
+    logstat(&l0);
+    t = timestamp();
+    for (int i = 0; i < BENCH_LARGE_SIZE / BENCH_LARGE_CHUNK; i++) {
+        if (filewrite(fp, buf, sizeof(buf)) != sizeof(buf)) {
+            fileclose(fp);
+            return -1;
+        }
+    }
+    log_sync();
+    t = timestamp() - t;
+    logstat(&l1);
+    fileclose(fp);
+
+    t = bench_ms(t);
+    cprintf("large write (%s): %dKB in %lld ms, %lld KB/s, %lld blocks logged, %lld written in place\n",
+        log_ordered() ? "ordered" : "journal", BENCH_LARGE_SIZE / 1024, t,
+        BENCH_LARGE_SIZE / 1024 * 1000 / t, l1.nblock - l0.nblock, l1.ndata - l0.ndata);
+    return 0;
+}
+
+/*
+ * Large-read benchmark: read back the file bench_large_write wrote, in
+ * BENCH_LARGE_CHUNK reads, checking its contents.
+ */
+int bench_large_read()
+{
+    static char buf[BENCH_LARGE_CHUNK];
+    struct file* fp;
+    uint64_t t;
+    int n;
+
+    if ((fp = bench_open("largew", 0)) == 0)
+        return -1;
+
+    t = timestamp();
+    for (int i = 0; i < BENCH_LARGE_SIZE / BENCH_LARGE_CHUNK; i++) {
+        n = fileread(fp, buf, sizeof(buf));
+        for (int j = 0; j < n; j++) {
+            if (buf[j] != 'y')
+                n = -1;
+        }
+        if (n != sizeof(buf)) {
+            fileclose(fp);
+            return -1;
+        }
+    }
+    t = timestamp() - t;
+    fileclose(fp);
+
+    t = bench_ms(t);
+    cprintf("large read: %dKB in %lld ms, %lld KB/s\n",
+        BENCH_LARGE_SIZE / 1024, t, BENCH_LARGE_SIZE / 1024 * 1000 / t);
+    return 0;
+}
+
+/*
+ * Copy benchmark: copy the file bench_large_write wrote, once by
+ * reading into and writing from a buffer in BENCH_LARGE_CHUNK pieces,
+ * once with filesend(), and report the throughput of each.  The copies
+ * and the file are removed afterwards.
+ */
+static int64_t bench_copy_one(char* to, int send)
+{
+    static char buf[BENCH_LARGE_CHUNK];
+    struct file* in, * out;
+    uint64_t t;
+    ssize_t n;
+
+    if ((in = bench_open("largew", 0)) == 0)
+        return -1;
+    if ((out = bench_open(to, 1)) == 0) {
+        fileclose(in);
+        return -1;
+    }
+
+    t = timestamp();
+    if (send) {
+        n = filesend(out, in, &in->off, BENCH_LARGE_SIZE);
+    } else {
+        n = 0;
+        while (n < BENCH_LARGE_SIZE && fileread(in, buf, sizeof(buf)) == sizeof(buf)
+            && filewrite(out, buf, sizeof(buf)) == sizeof(buf))
+            n += sizeof(buf);
+    }
+    log_sync();
+    t = timestamp() - t;
+    fileclose(in);
+    fileclose(out);
+    if (bench_remove(to) < 0 || n != BENCH_LARGE_SIZE)
+        return -1;
+    return bench_ms(t);
+}
+
+int bench_copy()
+{
+    int64_t t0, t1;
+
+    t0 = bench_copy_one("copyrw", 0);
+    t1 = t0 < 0 ? -1 : bench_copy_one("copysf", 1);
+    if (bench_remove("largew") < 0 || t1 < 0)
+        return -1;
+    cprintf("copy: %dKB, read/write %lld ms %lld KB/s, sendfile %lld ms %lld KB/s\n",
+        BENCH_LARGE_SIZE / 1024, t0, BENCH_LARGE_SIZE / 1024 * 1000 / t0,
+        t1, BENCH_LARGE_SIZE / 1024 * 1000 / t1);
+    return 0;
+}
+
 void
 test_file_system()
 {
@@ -175,5 +741,52 @@ test_file_system()
     TEST_FUNC(test_mkdir);
     TEST_FUNC(test_initial_scan);
     TEST_FUNC(test_rmdir);
+    TEST_FUNC(test_large_dir);
+    TEST_FUNC(test_page_cache);
+    TEST_FUNC(test_inline);
+    TEST_FUNC(test_iovec);
+    TEST_FUNC(test_alloc);
+    TEST_FUNC(bench_small_write);
+    TEST_FUNC(bench_large_write);
+    TEST_FUNC(bench_large_read);
+    TEST_FUNC(bench_copy);
+
+    struct bstat bs;
+    bstat(&bs);
+    cprintf("bcache: %lld buffers, %lld hits, %lld misses, %lld evictions\n",
+        bs.nbuf, bs.hit, bs.miss, bs.evict);
+    cprintf("readahead: %lld blocks, %lld used, %lld wasted\n", bs.ra, bs.rahit, bs.rawaste);
+    cprintf("writeback: %lld sync, %lld async, %lld by flusher in %lld batches, %lld dirty, %lld throttled\n",
+        bs.wsync, bs.wasync, bs.wback, bs.wbatch, bs.dirty, bs.throttle);
+
+    struct istat is;
+    istat(&is);
+    cprintf("icache: %lld inodes, %lld hits, %lld misses, %lld evictions\n",
+        is.ninode, is.hit, is.miss, is.evict);
+
+    struct pstat ps;
+    pstat(&ps);
+    cprintf("pcache: %lld pages, %lld hits, %lld misses, %lld evictions\n",
+        ps.npage, ps.hit, ps.miss, ps.evict);
+
+    struct dstat ds;
+    dstat(&ds);
+    cprintf("dcache: %lld hits, %lld negative hits, %lld misses\n", ds.hit, ds.neghit, ds.miss);
+
+    struct logstat ls;
+    logstat(&ls);
+    cprintf("log: %lld ops in %lld commits of %lld blocks, %lld syncs, %lld replayed\n",
+        ls.nop, ls.ncommit, ls.nblock, ls.nsync, ls.nreplay);
+    cprintf("checkpoint: %lld times, %lld blocks from cache, %lld from log, %lld superseded\n",
+        ls.ncheckpoint, ls.nckblock, ls.nckcopy, ls.nckskip);
+
+    struct mount* m = getmount(ROOTDEV);
+    cprintf("mount: %d free blocks, %d free inodes\n", m->nfree, m->nifree);
+
+    struct blkstat ks;
+    blkstat(ROOTDEV, &ks);
+    cprintf("blk: %lld reads, %lld writes in %lld/%lld transfers, %lld expired, depth avg %lld max %lld\n",
+        ks.nreq[BLK_READ], ks.nreq[BLK_WRITE], ks.ndispatch[BLK_READ], ks.ndispatch[BLK_WRITE],
+        ks.nexpire, ks.depth_sum / MAX(ks.nreq[BLK_READ] + ks.nreq[BLK_WRITE], 1), ks.depth_max);
     do {} while (0);
 }
\ No newline at end of file
@@ -20,6 +20,7 @@ struct run {
 struct {
     struct spinlock lock;
     struct run* free_list; /* Free list of physical pages */
+    size_t nfree;          /* Number of pages on free_list */
 } kmem;
 
 void
@@ -47,6 +48,7 @@ kfree(char* v)
     acquire(&kmem.lock);
     r->next = kmem.free_list;
     kmem.free_list = r;
+    kmem.nfree++;
     release(&kmem.lock);
 }
 
@@ -74,6 +76,7 @@ kalloc()
     r = kmem.free_list;
     if (r) {
         kmem.free_list = r->next;
+        kmem.nfree--;
     }
     release(&kmem.lock);
     if (r) {
@@ -82,6 +85,18 @@ kalloc()
     return (char*)r;
 }
 
+/* Number of physical pages currently available to kalloc(). */
+size_t
+free_page_count()
+{
+    size_t n;
+
+    acquire(&kmem.lock);
+    n = kmem.nfree;
+    release(&kmem.lock);
+    return n;
+}
+
 void
 check_free_list()
 {
@@ -1,4 +1,5 @@
 #include "types.h"
+#include "arm.h"
 #include "console.h"
 #include "spinlock.h"
 #include "sleeplock.h"
@@ -6,6 +7,9 @@
 #include "buf.h"
 #include "string.h"
 #include "file.h"
+#include "proc.h"
+#include "log.h"
+#include "blk.h"
 
 /* Simple logging that allows concurrent FS system calls.
  *
@@ -15,44 +19,134 @@
  * any reasoning required about whether a commit might
  * write an uncommitted system call's updates to disk.
  *
+ * Commits are grouped: end_op() does not commit, it leaves the
+ * transaction open for the next system calls.  The logcommit thread
+ * commits it once it is LOG_COMMIT_TICKS old, holds LOG_COMMIT_BLOCKS
+ * blocks, someone is waiting for log space, or log_sync() asks for it.
+ *
  * A system call should call begin_op()/end_op() to mark
  * its start and end. Usually begin_op() just increments
  * the count of in-progress FS system calls and returns.
- * But if it thinks the log is close to running out, it
- * sleeps until the last outstanding end_op() commits.
+ * But if the open transaction has no room left to reserve
+ * MAXOPBLOCKS for this call, it counts itself as waiting for
+ * log space, which makes the committer close the transaction
+ * once the outstanding calls end, and sleeps until it has.
+ *
+ * The log is a physical re-do log containing disk blocks, and is
+ * pipelined: the committer copies the blocks of the closing
+ * transaction into log buffers and opens the next one at once, so
+ * system calls keep running while the copies are written.
+ *
+ * In LOG_ORDERED mode only metadata goes through the log.  File data
+ * blocks are handed to log_write_data(), which leaves them to the
+ * flusher but remembers them with the transaction, and the committer
+ * writes out whatever is still dirty before the transaction's
+ * metadata.  Blocks that recovery could still replay are not given
+ * out as file data, nor are blocks freed by a transaction that has
+ * not committed yet, since after a crash their old owner would still
+ * point at them, see log_busy().
+ *
+ * Checkpointing is lazy.  Committed blocks stay pinned in the cache
+ * and are installed to their home locations only every
+ * LOG_CHECKPOINT_TICKS, or when the log is running out of space, so
+ * a block logged by many transactions is installed once.  A block a
+ * later committed transaction logs again is left to that one; a block
+ * the open transaction has modified since is installed from its copy
+ * in the log.
  *
- * The log is a physical re-do log containing disk blocks.
- * The on-disk log format:
- *   header block, containing block #s for block A, B, C, ...
+ * The on-disk log is a super block followed by a circular area:
+ *   super block, containing the position and tid of the oldest
+ *     transaction recovery still has to replay
+ *   descriptor block, containing tid, block #s for block A, B, ...
+ *     and a CRC32C over itself and the blocks
  *   block A
  *   block B
- *   block C
  *   ...
- * Log appends are synchronous.
+ *   descriptor block of the next transaction ...
+ * A transaction is written as one multi-block write, and commits
+ * when all of it is on disk: recovery stops at the first descriptor
+ * whose CRC does not match.
+ * A transaction never wraps around the end of the area; it starts
+ * over at the beginning instead.  Positions below are virtual offsets
+ * that keep growing, the block is at the offset modulo the area size.
+ * The super block is rewritten lazily, and only forced out before
+ * the head would overwrite a transaction it still points before.
  */
 
+#define LOG_DESC    0x4c4f4744  // "LOGD"
+
  /*
-  * Contents of the header block, used for both the on-disk header block
-  * and to keep track in memory of logged block# before commit.
+  * Contents of the descriptor block, also used to keep
+  * track in memory of logged block# before commit.
   */
 struct logheader {
+    uint32_t magic;
+    uint32_t n;
+    uint64_t tid;
+    uint32_t crc;       // Of the logged blocks, then this header with crc 0.
+    uint32_t block[LOGSIZE];
+};
+
+/* A committed transaction still in the log. */
+struct trans {
+    uint64_t v;         // Offset of its descriptor.
+    struct logheader lh;
+};
+
+#define NTRANS  (NLOG / 2)  // Each takes at least two blocks.
+
+/* File data blocks written in place by a transaction. */
+struct datalist {
+    int n;
+    uint32_t block[LOG_MAXDATA];
+};
+
+/*
+ * Blocks freed by a transaction: for each bitmap block it changed,
+ * a bit per block it freed there.  A transaction logs every bitmap
+ * block it changes, so it changes at most LOGSIZE of them.
+ */
+struct freeset {
     int n;
-    int block[LOGSIZE];
+    uint32_t bmap[LOGSIZE];     // Index of the bitmap block, b / BPB
+    uint8_t bits[LOGSIZE][BPB / 8];
 };
 
 struct log {
     struct spinlock lock;
-    int start;
-    int size;
+    int start;          // The super block, the circular area follows.
+    int size;           // Blocks in the circular area.
     int outstanding;    // How many FS sys calls are executing.
-    int committing;     // In commit(), please wait.
+    int committing;     // Copying the closing transaction, please wait.
+    int waiting;        // begin_op() callers out of log space.
+    int force;          // log_sync() wants the transaction committed.
+    int age;            // Clock ticks the transaction has had blocks to commit.
+    int ckage;          // Clock ticks since the last checkpoint.
+    uint64_t tid;       // The open transaction.
+    uint64_t done;      // The last transaction committed.
+    uint64_t head;      // Where the next transaction goes.
+    uint64_t tail;      // The oldest transaction recovery needs.
+    uint64_t dtail;     // ... according to the super block on disk.
     int dev;
-    struct logheader lh;
+    int mode;           // LOG_JOURNAL or LOG_ORDERED.
+    struct logheader lh;    // The open transaction.
+    struct logheader ct;    // The committing one, owned by logcommit.
+    struct datalist ld;     // Data of the open transaction.
+    struct datalist cd;     // ... of the committing one.
+    struct freeset* lf;     // Blocks the open transaction freed.
+    struct freeset* cf;     // ... the committing one.
+    struct trans cp[NTRANS];    // The committed ones, oldest at cp0.
+    int cp0;
+    int ncp;
+    struct logstat st;
 };
 struct log log;
 
+static struct buf cpbuf;    // Installs blocks from their log copy.
+static struct freeset freeset[2];
+
 static void recover_from_log();
-static void commit();
+static void log_committer();
 
 void
 initlog(int dev)
@@ -65,89 +159,177 @@ initlog(int dev)
     }
 
     initlock(&log.lock, "log");
+    initsleeplock(&cpbuf.lock, "cpbuf");
     readsb(dev, &sb);
 
     log.start = sb.logstart;
-    log.size = sb.nlog;
+    log.size = sb.nlog - 1;
     log.dev = dev;
+    log.lf = &freeset[0];
+    log.cf = &freeset[1];
+    if (log.size < 3 * LOGTXN)
+        panic("initlog: log too small");
     recover_from_log();
+    cprintf("log: %s mode\n", log.mode == LOG_ORDERED ? "ordered" : "journal");
 
+    kthread_create(log_committer, "logcommit");
+}
+
+/* Block number of the log block at offset v. */
+static int
+lblock(uint64_t v)
+{
+    return log.start + 1 + v % log.size;
 }
 
-/* Copy committed blocks from log to their home location. */
+/* Write the super block, now if sync, else through the flusher. */
 static void
-install_trans()
+write_super(uint64_t tail, uint64_t tid, int sync)
 {
-    /* TODO: Your code here. */
-    int tail;
-    struct buf* lbuf;
-    struct buf* dbuf;
-    for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf* buf = bread(log.dev, log.start);
+    struct logsuper* s = (struct logsuper*)(buf->data);
+
+    memset(buf->data, 0, BSIZE);
+    s->magic = LOG_SUPER;
+    s->tail = tail % log.size;
+    s->tid = tid;
+    s->mode = log.mode;
+    if (sync)
+        bwrite(buf);
+    else
+        bdwrite(buf);
+    brelse(buf);
+}
 
-        lbuf = bread(log.dev, log.start + tail + 1); // read log block
-        dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+/* Make sure the super block on disk no longer points before log.tail. */
+static void
+force_super()
+{
+    struct buf* buf = bread(log.dev, log.start);
 
-        memmove(dbuf->data, lbuf->data, BSIZE);
+    if (buf->flags & B_DELWRI)
+        bwrite(buf);
+    brelse(buf);
+    log.dtail = log.tail;
+}
 
-        bwrite(dbuf); //write dst to disk
-        brelse(lbuf);
-        brelse(dbuf);
-    }
+/* The CRC of descriptor lh, given the CRC of its blocks. */
+static uint32_t
+trans_crc(struct logheader* lh, uint32_t crc)
+{
+    struct logheader h = *lh;
 
+    h.crc = 0;
+    return crc32c(crc, &h, sizeof(h));
 }
 
-/* Read the log header from disk into the in-memory log header. */
-static void
-read_head()
+/*
+ * Read the header of transaction tid at offset v into lh.
+ * Return whether it is there and committed, all of it.
+ */
+static int
+read_trans(uint64_t v, uint64_t tid, struct logheader* lh)
 {
-    /* TODO: Your code here. */
     struct buf* buf;
-    struct logheader* lh;
-    int i;
-
-    buf = bread(log.dev, log.start);
-    lh = (struct logheader*)(buf->data);
-    log.lh.n = lh->n;
+    struct logheader* hb;
+    uint32_t crc;
+    int ok, i;
+
+    buf = bread(log.dev, lblock(v));
+    hb = (struct logheader*)(buf->data);
+    ok = hb->magic == LOG_DESC && hb->tid == tid && hb->n <= LOGSIZE &&
+        v % log.size + hb->n + 1 <= log.size;
+    if (ok)
+        memmove(lh, hb, sizeof(*lh));
+    brelse(buf);
+    if (!ok)
+        return 0;
 
-    for (i = 0; i < log.lh.n; i++) {
-        log.lh.block[i] = lh->block[i];
+    for (i = 0, crc = 0; i < lh->n; i++) {
+        buf = bread(log.dev, lblock(v + 1 + i));
+        crc = crc32c(crc, buf->data, BSIZE);
+        brelse(buf);
     }
-
-    brelse(buf);
+    return trans_crc(lh, crc) == lh->crc;
 }
 
 /*
- * Write in-memory log header to disk.
- * This is the true point at which the
- * current transaction commits.
+ * Copy the n logged blocks, block[i] at log offset from[i],
+ * to their home location.
  */
 static void
-write_head()
+install_from_log(uint32_t* block, uint64_t* from, int n)
 {
-    struct buf* buf = bread(log.dev, log.start);
-    struct logheader* hb = (struct logheader*)(buf->data);
-    int i;
-    hb->n = log.lh.n;
+    int tail, i;
+    struct buf* lbuf;
+    struct buf* dbuf[LOGSIZE];
 
-    for (i = 0; i < log.lh.n; i++) {
-        hb->block[i] = log.lh.block[i];
-    }
-    bwrite(buf);
+    for (i = 0; i < n; i += LOGSIZE) {
+        for (tail = 0; tail < MIN(n - i, LOGSIZE); tail++) {
+            lbuf = bread(log.dev, lblock(from[i + tail])); // read log block
+            dbuf[tail] = bread(log.dev, block[i + tail]); // read dst
 
-    brelse(buf);
+            memmove(dbuf[tail]->data, lbuf->data, BSIZE);
 
+            bwrite_start(dbuf[tail]); // write dst to disk
+            brelse(lbuf);
+        }
+        for (tail = 0; tail < MIN(n - i, LOGSIZE); tail++) {
+            bwait(dbuf[tail]);
+            brelse(dbuf[tail]);
+        }
+    }
 }
 
+/*
+ * Replay every committed transaction from the one the super block
+ * points at, then start the log over empty.  A block logged by
+ * several transactions is only installed from the last of them.
+ */
 static void
 recover_from_log()
 {
     /* TODO: Your code here. */
-    read_head();
+    static uint32_t block[NLOG];
+    static uint64_t from[NLOG];
+    struct buf* buf;
+    struct logsuper s;
+    struct logheader lh;
+    uint64_t v, tid;
+    int i, j, n = 0;
 
-    install_trans(); // if committed, copy from log to disk
-    log.lh.n = 0;
-    write_head();
+    buf = bread(log.dev, log.start);
+    memmove(&s, buf->data, sizeof(s));
+    brelse(buf);
+    if (s.magic != LOG_SUPER) {     // Fresh file system
+        s.tail = 0;
+        s.tid = 1;
+        s.mode = LOG_JOURNAL;
+    }
+    log.mode = s.mode == LOG_ORDERED ? LOG_ORDERED : LOG_JOURNAL;
 
+    for (v = s.tail, tid = s.tid; ; v += lh.n + 1, tid++) {
+        // The transaction may have started over at the beginning.
+        if (!read_trans(v, tid, &lh) &&
+            (v % log.size == 0 || !read_trans(v += log.size - v % log.size, tid, &lh)))
+            break;
+        for (i = 0; i < lh.n; i++) {
+            for (j = 0; j < n && block[j] != lh.block[i]; j++)
+                ;
+            block[j] = lh.block[i];
+            from[j] = v + 1 + i;
+            n += j == n;
+        }
+        log.st.nreplay++;
+    }
+    install_from_log(block, from, n); // if committed, copy from log to disk
+    if (tid != s.tid)
+        cprintf("log: replayed transactions %lld to %lld\n", s.tid, tid - 1);
+
+    log.tid = tid;
+    log.done = tid - 1;
+    log.head = log.tail = log.dtail = 0;
+    write_super(0, tid, 1);
 }
 
 /* Called at the start of each FS system call. */
@@ -162,10 +344,14 @@ begin_op()
         }
         else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
             // this op might exhaust log space; wait for commit.
+            log.waiting++;
+            wakeup(&log.tid);
             sleep(&log, &log.lock);
+            log.waiting--;
         }
         else {
             log.outstanding += 1;
+            log.st.nop++;
             break;
         }
     }
@@ -174,77 +360,348 @@ begin_op()
 
 /*
  * Called at the end of each FS system call.
- * Commits if this was the last outstanding operation.
+ * The transaction stays open for later calls; the committer
+ * is told when the last outstanding operation has ended.
  */
 void
 end_op()
 {
     /* TODO: Your code here. */
-    int do_commit = 0;
-
     acquire(&log.lock);
     log.outstanding -= 1;
 
     if (log.committing)
         panic("log.committing");
 
-    if (log.outstanding == 0) {
-        do_commit = 1;
-        log.committing = 1;
+    if (log.outstanding == 0)
+        wakeup(&log.tid);
+    // begin_op() may be waiting for log space,
+    // and decrementing log.outstanding has decreased
+    // the amount of reserved space.
+    wakeup(&log);
+    release(&log.lock);
+}
+
+/* Whether the committer should commit the open transaction now. */
+static int
+commit_due()
+{
+    if (log.outstanding || (log.lh.n == 0 && log.ld.n == 0))
+        return 0;
+    return log.force || log.waiting || log.age >= LOG_COMMIT_TICKS ||
+        log.lh.n >= LOG_COMMIT_BLOCKS || log.ld.n >= LOG_MAXDATA / 2;
+}
+
+/* Log blocks free for new transactions. */
+static uint64_t
+log_free()
+{
+    return log.size - (log.head - log.tail);
+}
+
+/*
+ * Whether the committer should checkpoint: it is time to, or the log
+ * may not have room for the open transaction, wherever it wraps.
+ */
+static int
+checkpoint_due()
+{
+    if (log.ncp == 0)
+        return 0;
+    return log.ckage >= LOG_CHECKPOINT_TICKS || log_free() < 2 * LOGTXN ||
+        log.ncp == NTRANS;
+}
+
+/*
+ * Find room for the committing transaction at the head of the log
+ * and return its offset.
+ */
+static uint64_t
+log_reserve()
+{
+    uint64_t v = log.head, len = log.ct.n + 1;
+
+    if (v % log.size + len > log.size)
+        v += log.size - v % log.size;
+    if (v + len > log.tail + log.size)
+        panic("log_reserve: log full");
+    if (v + len > log.dtail + log.size)
+        force_super();
+    log.head = v + len;
+    return v;
+}
+
+/*
+ * Copy the committing transaction's blocks from cache to the log at
+ * offset v, behind its descriptor.  The log buffers are returned in
+ * to[], locked, descriptor first, to be written all in one go.
+ */
+static void
+write_log(uint64_t v, struct buf** to)
+{
+    /* TODO: Your code here. */
+    int tail;
+    uint32_t crc = 0;
+    struct buf* from;
+
+    for (tail = 0; tail < log.ct.n; tail++) {
+        to[tail + 1] = bgetblk(log.dev, lblock(v + 1 + tail)); // log block
+        from = bread(log.dev, log.ct.block[tail]); // cache block
+
+        memmove(to[tail + 1]->data, from->data, BSIZE);
+        crc = crc32c(crc, from->data, BSIZE);
+        brelse(from);
     }
-    else {
-        // begin_op() may be waiting for log space,
-        // and decrementing log.outstanding has decreased
-        // the amount of reserved space.
-        wakeup(&log);//to tell log that there are more space now
+
+    log.ct.crc = trans_crc(&log.ct, crc);
+    to[0] = bgetblk(log.dev, lblock(v));
+    memset(to[0]->data, 0, BSIZE);
+    memmove(to[0]->data, &log.ct, sizeof(log.ct));
+}
+
+/*
+ * Write the committing transaction's file data that is still dirty,
+ * and wait for it.  One buffer is held at a time, as in checkpoint().
+ */
+static void
+write_data()
+{
+    static uint32_t done[LOG_MAXDATA];
+    struct buf* b;
+    int i, n;
+
+    for (i = n = 0; i < log.cd.n; i++) {
+        b = bread(log.dev, log.cd.block[i]);
+        if (b->flags & B_DELWRI) {
+            done[n++] = b->blockno;
+            bawrite(b);
+        } else
+            brelse(b);
     }
+    for (i = 0; i < n; i++)
+        brelse(bread(log.dev, done[i]));
+    log.st.ndata += n;
+}
+
+/* Whether transaction lh logs block b. */
+static int
+in_trans(struct logheader* lh, uint32_t b)
+{
+    int i;
+
+    for (i = 0; i < lh->n; i++)
+        if (lh->block[i] == b)
+            return 1;
+    return 0;
+}
+
+/* Whether f holds block b. */
+static int
+in_freeset(struct freeset* f, uint32_t b)
+{
+    int i;
+
+    for (i = 0; i < f->n; i++)
+        if (f->bmap[i] == b / BPB)
+            return (f->bits[i][b % BPB / 8] >> (b % 8)) & 1;
+    return 0;
+}
+
+/* Whether a committed transaction after the k-th oldest logs block b. */
+static int
+logged_later(int k, uint32_t b)
+{
+    for (k++; k < log.ncp; k++)
+        if (in_trans(&log.cp[(log.cp0 + k) % NTRANS].lh, b))
+            return 1;
+    return 0;
+}
+
+/*
+ * Install the blocks of every committed transaction, then let the
+ * log reuse their space.  Only one home buffer is held at a time,
+ * since system calls may be holding one and waiting for another.
+ */
+static void
+checkpoint()
+{
+    static uint32_t done[NLOG];
+    struct trans* t;
+    struct buf* dbuf, * lbuf;
+    uint64_t tail, tid;
+    int k, i, n, ncp;
+
+    acquire(&log.lock);
+    ncp = log.ncp;
+    log.ckage = 0;
+    release(&log.lock);
+
+    for (k = n = 0; k < ncp; k++) {
+        t = &log.cp[(log.cp0 + k) % NTRANS];
+        for (i = 0; i < t->lh.n; i++) {
+            if (logged_later(k, t->lh.block[i])) {
+                log.st.nckskip++;
+                continue;
+            }
+            dbuf = bread(log.dev, t->lh.block[i]);
+            acquire(&log.lock);
+            if (!in_trans(&log.lh, dbuf->blockno)) {
+                release(&log.lock);
+                done[n++] = dbuf->blockno;
+                bawrite(dbuf);
+                continue;
+            }
+            release(&log.lock);
+            brelse(dbuf);
+
+            // The cached block has uncommitted changes, use the log.
+            lbuf = bread(log.dev, lblock(t->v + 1 + i));
+            memmove(cpbuf.data, lbuf->data, BSIZE);
+            brelse(lbuf);
+            cpbuf.dev = log.dev;
+            cpbuf.blockno = t->lh.block[i];
+            cpbuf.flags = B_VALID | B_DIRTY;
+            blkrw(&cpbuf);
+            log.st.nckcopy++;
+        }
+    }
+    // Wait for the writes by taking each buffer once more.
+    for (i = 0; i < n; i++)
+        brelse(bread(log.dev, done[i]));
+
+    // Only the committer adds transactions, so the ones left are known.
+    acquire(&log.lock);
+    t = &log.cp[(log.cp0 + ncp) % NTRANS];
+    tail = log.ncp > ncp ? t->v : log.head;
+    tid = log.ncp > ncp ? t->lh.tid : log.tid;
+    release(&log.lock);
+
+    // In ordered mode a block out of the log may become file data, so
+    // recovery must not replay its older copies any more.  The blocks
+    // stay busy for log_busy() until the new tail is on disk.
+    write_super(tail, tid, log.mode == LOG_ORDERED);
+
+    acquire(&log.lock);
+    log.cp0 = (log.cp0 + ncp) % NTRANS;
+    log.ncp -= ncp;
+    log.tail = tail;
+    if (log.mode == LOG_ORDERED)
+        log.dtail = tail;
+    log.st.ncheckpoint++;
+    log.st.nckblock += n;
     release(&log.lock);
+}
+
+/*
+ * The logcommit thread.  Commits run here rather than in end_op(),
+ * so the system call closing a batch returns without waiting for it,
+ * and new system calls only wait while its blocks are being copied.
+ */
+static void
+log_committer()
+{
+    struct buf* to[LOGSIZE + 1];
+    struct freeset* f;
+    uint64_t v;
+    int i;
+
+    acquire(&log.lock);
+    while (1) {
+        while (!commit_due() && !checkpoint_due())
+            sleep(&log.tid, &log.lock);
+        if (checkpoint_due()) {
+            release(&log.lock);
+            checkpoint();
+            acquire(&log.lock);
+            continue;
+        }
+        log.committing = 1;
+        log.force = 0;
+        log.age = 0;
+        log.ct = log.lh;
+        log.ct.magic = LOG_DESC;
+        log.ct.tid = log.tid++;
+        log.lh.n = 0;
+        log.cd = log.ld;
+        log.ld.n = 0;
+        f = log.cf;     // Emptied when the last commit finished.
+        log.cf = log.lf;
+        log.lf = f;
+        release(&log.lock);
 
-    if (do_commit) {
         // call commit w/o holding locks, since not allowed
         // to sleep with locks.
-        commit();
+        v = log_reserve();
+        write_log(v, to);   // Copy modified blocks from cache to log
+
         acquire(&log.lock);
         log.committing = 0;
         wakeup(&log);
         release(&log.lock);
+
+        write_data();       // Data must be on disk before the metadata
+        bwrite_startv(to, log.ct.n + 1);    // write the log
+
+        // Once all of it is on disk, the transaction has committed.
+        for (i = 0; i <= log.ct.n; i++) {
+            bwait(to[i]);
+            brelse(to[i]);
+        }
+
+        acquire(&log.lock);
+        log.cp[(log.cp0 + log.ncp++) % NTRANS] = (struct trans){ v, log.ct };
+        log.done = log.ct.tid;
+        for (i = 0; i < log.cf->n; i++)
+            memset(log.cf->bits[i], 0, sizeof(log.cf->bits[i]));
+        log.cf->n = 0;
+        log.st.ncommit++;
+        log.st.nblock += log.ct.n;
+        wakeup(&log);
     }
 }
 
-/* Copy modified blocks from cache to log. */
-static void
-write_log()
+/* Wait until every operation that has ended is committed. */
+void
+log_sync()
 {
-    /* TODO: Your code here. */
-    int tail;
-
-    for (tail = 0; tail < log.lh.n; tail++) {
-        struct buf* to = bread(log.dev, log.start + tail + 1); // log block
-        struct buf* from = bread(log.dev, log.lh.block[tail]); // cache block
+    uint64_t t;
 
-        memmove(to->data, from->data, BSIZE);
-        bwrite(to);  // write the log
-        brelse(from);
-        brelse(to);
+    acquire(&log.lock);
+    log.st.nsync++;
+    t = log.lh.n || log.ld.n ? log.tid : log.tid - 1;
+    while (log.done < t) {
+        log.force = 1;
+        wakeup(&log.tid);
+        sleep(&log, &log.lock);
     }
+    release(&log.lock);
 }
 
-static void
-commit()
+/* Called on every clock tick to age the open transaction. */
+void
+log_tick()
 {
-    /* TODO: Your code here. */
-    if (log.lh.n > 0) {
-        write_log();     // Write modified blocks from cache to log
-        write_head();    // Write header to disk -- the real commit
-        install_trans(); // Now install writes to home locations
-        log.lh.n = 0;
-        write_head();    // Erase the transaction from the log
-    }
+    if (log.size == 0)  // No log yet.
+        return;
+    acquire(&log.lock);
+    if ((log.lh.n || log.ld.n) && ++log.age >= LOG_COMMIT_TICKS)
+        wakeup(&log.tid);
+    if (log.ncp && ++log.ckage >= LOG_CHECKPOINT_TICKS)
+        wakeup(&log.tid);
+    release(&log.lock);
+}
+
+void
+logstat(struct logstat* st)
+{
+    acquire(&log.lock);
+    *st = log.st;
+    release(&log.lock);
 }
 
 /* Caller has modified b->data and is done with the buffer.
  * Record the block number and pin in the cache with B_DIRTY.
- * commit()/write_log() will do the disk write.
+ * The committer will do the disk write.
  *
  * log_write() replaces bwrite(); a typical use is:
  *   bp = bread(...)
@@ -258,19 +715,20 @@ log_write(struct buf* b)
     /* TODO: Your code here. */
     int i;
 
-    // if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    //     panic("too big a transaction");
     // if (log.outstanding < 1)
     //     panic("log_write outside of trans");
 
     acquire(&log.lock);
     for (i = 0; i < log.lh.n; i++) {
         // find the corresponding block
-        if (log.lh.block[i] == b->blockno - 0x20800)   // log absorbtion
+        if (log.lh.block[i] == b->blockno)   // log absorbtion
             break;
     }
+    // Some operation wrote more than the MAXOPBLOCKS begin_op() reserved.
+    if (i == LOGSIZE)
+        panic("too big a transaction");
     // in case no corresponding block
-    log.lh.block[i] = b->blockno - 0x20800;
+    log.lh.block[i] = b->blockno;
 
     if (i == log.lh.n) {
         log.lh.n++;
@@ -279,5 +737,108 @@ log_write(struct buf* b)
     //after modification, set the dirty bit
     b->flags |= B_DIRTY; // prevent eviction
     release(&log.lock);
+
+    // A freed data block may come back as metadata while still
+    // waiting for the flusher; from now on only the log writes it.
+    bforget(b);
+}
+
+/*
+ * Caller has modified file data in b and is done with the buffer.
+ * In ordered mode, write it in place before the transaction commits,
+ * else log it like metadata.
+ */
+void
+log_write_data(struct buf* b)
+{
+    int i;
+
+    if (log.mode != LOG_ORDERED) {
+        log_write(b);
+        return;
+    }
+
+    acquire(&log.lock);
+    for (i = 0; i < log.ld.n; i++)
+        if (log.ld.block[i] == b->blockno)
+            break;
+    if (i == LOG_MAXDATA) {
+        // Too much data for the commit to keep track of, write it now.
+        release(&log.lock);
+        bwrite(b);
+        return;
+    }
+    if (i == log.ld.n)
+        log.ld.block[log.ld.n++] = b->blockno;
+    release(&log.lock);
+    bdwrite(b);
+}
+
+/*
+ * Called by bfree() with the bitmap block of b held, once b is free
+ * in it.  In ordered mode b stays busy until the transaction commits.
+ */
+void
+log_freed(uint32_t b)
+{
+    struct freeset* f;
+    int i;
+
+    if (log.mode != LOG_ORDERED)
+        return;
+    acquire(&log.lock);
+    f = log.lf;
+    for (i = 0; i < f->n; i++)
+        if (f->bmap[i] == b / BPB)
+            break;
+    if (i == LOGSIZE)
+        panic("log_freed: too many bitmap blocks");
+    if (i == f->n)
+        f->bmap[f->n++] = b / BPB;
+    f->bits[i][b % BPB / 8] |= 1 << (b % 8);
+    release(&log.lock);
 }
 
+/*
+ * Whether block b of dev belongs to the open or the committing
+ * transaction, so that only the log may write it.
+ */
+int
+log_pinned(uint32_t dev, uint32_t b)
+{
+    int pinned;
+
+    if (dev != log.dev)
+        return 0;
+    acquire(&log.lock);
+    pinned = in_trans(&log.lh, b) || in_trans(&log.ct, b);
+    release(&log.lock);
+    return pinned;
+}
+
+int
+log_ordered()
+{
+    return log.mode == LOG_ORDERED;
+}
+
+/*
+ * Whether block b may not become file data yet, since in ordered mode
+ * recovery could replay an older copy of it over the data, or the
+ * transaction that freed it has not committed.
+ */
+int
+log_busy(uint32_t b)
+{
+    int k, busy;
+
+    if (log.mode != LOG_ORDERED)
+        return 0;
+    acquire(&log.lock);
+    busy = in_trans(&log.lh, b) || in_trans(&log.ct, b) ||
+        in_freeset(log.lf, b) || in_freeset(log.cf, b);
+    for (k = 0; k < log.ncp && !busy; k++)
+        busy = in_trans(&log.cp[(log.cp0 + k) % NTRANS].lh, b);
+    release(&log.lock);
+    return busy;
+}
@@ -13,7 +13,11 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "sd.h"
+#include "blk.h"
+#include "ramdisk.h"
+#include "fs.h"
 #include "log.h"
+#include "pcache.h"
 
 struct cpu cpus[NCPU];
 
@@ -77,8 +81,13 @@ main()
         user_idle_init();
         user_idle_init();
         user_idle_init();
+        blk_init();
         sd_init();
+#ifdef RAMDISK_ROOT
+        ramdisk_init(FSSIZE);
+#endif
         binit();
+        pcache_init();
         fileinit();
 
         cprintf("init the proc successfully\n");
@@ -0,0 +1,313 @@
+/* Page cache.
+ *
+ * The page cache holds regular file data in whole pages of BPP
+ * blocks, found through a radix tree per inode rooted at ip->pages.
+ * A read that hits copies straight from the page, without mapping
+ * blocks or going through the buffer cache.
+ *
+ * Interface:
+ * * pget returns the page at an index of a file, referenced, and
+ *     adds an empty one if there is none.
+ * * Filling a page from disk and writing it back are left to the
+ *     file system, which knows where the blocks are (see fs.c).
+ * * pput drops the reference; the page stays cached.
+ * * pdrop forgets all pages of a file, when it is truncated or its
+ *     inode is recycled.
+ *
+ * All trees and the LRU list are protected by pcache.lock.  A page
+ * is only recycled while nobody references it, so its data can be
+ * used without the lock between pget and pput.  The pages and their
+ * data are allocated at boot; tree nodes are carved out of pages
+ * as needed and kept on a free list.
+ */
+
+#include "types.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "console.h"
+#include "kalloc.h"
+#include "string.h"
+#include "file.h"
+#include "pcache.h"
+
+struct {
+    struct spinlock lock;
+    struct page* mru;       /* Circular LRU list; mru->prev is least recent. */
+    struct radix_node* nfree;   /* Free tree nodes, through slot[0] */
+    int npage;
+    uint64_t hit;
+    uint64_t miss;
+    uint64_t evict;
+} pcache;
+
+/* Indexes below this fit in a tree of height h. */
+#define RADIX_SPAN(h) ((h) * RADIX_SHIFT >= 32 ? ~0ULL : 1ULL << ((h) * RADIX_SHIFT))
+#define RADIX_SLOT(index, h) (((index) >> (((h) - 1) * RADIX_SHIFT)) & (RADIX_SLOTS - 1))
+
+/* Unlink pg from the LRU list. */
+static void
+lru_remove(struct page* pg)
+{
+    if (pg->next == pg) {
+        pcache.mru = 0;
+    } else {
+        pg->next->prev = pg->prev;
+        pg->prev->next = pg->next;
+        if (pcache.mru == pg)
+            pcache.mru = pg->next;
+    }
+}
+
+/* Insert pg as most recently used if it is cached, else as the first to recycle. */
+static void
+lru_insert(struct page* pg)
+{
+    if (pcache.mru == 0) {
+        pg->next = pg->prev = pg;
+    } else {
+        pg->next = pcache.mru;
+        pg->prev = pcache.mru->prev;
+        pcache.mru->prev->next = pg;
+        pcache.mru->prev = pg;
+    }
+    pcache.mru = pg->ip ? pg : pg->next;
+}
+
+static struct radix_node*
+node_alloc()
+{
+    struct radix_node* n;
+    char* p;
+
+    if (pcache.nfree == 0) {
+        if ((p = kalloc()) == 0)
+            panic("pcache: out of memory");
+        for (n = (struct radix_node*)p; n + 1 <= (struct radix_node*)(p + PGSIZE); n++) {
+            n->slot[0] = pcache.nfree;
+            pcache.nfree = n;
+        }
+    }
+    n = pcache.nfree;
+    pcache.nfree = n->slot[0];
+    memset(n, 0, sizeof(*n));
+    return n;
+}
+
+static void
+node_free(struct radix_node* n)
+{
+    n->slot[0] = pcache.nfree;
+    pcache.nfree = n;
+}
+
+static struct page*
+radix_lookup(struct inode* ip, uint32_t index)
+{
+    struct radix_node* n = ip->pages;
+    int h;
+
+    if (n == 0 || index >= RADIX_SPAN(ip->pheight))
+        return 0;
+    for (h = ip->pheight; h > 1 && n; h--)
+        n = n->slot[RADIX_SLOT(index, h)];
+    return n ? n->slot[RADIX_SLOT(index, 1)] : 0;
+}
+
+/* Add pg at index, which must be free, growing the tree as needed. */
+static void
+radix_insert(struct inode* ip, uint32_t index, struct page* pg)
+{
+    struct radix_node* n, * root;
+    void** s;
+    int h;
+
+    if (ip->pages == 0) {
+        ip->pages = node_alloc();
+        ip->pheight = 1;
+    }
+    while (index >= RADIX_SPAN(ip->pheight)) {
+        root = node_alloc();
+        root->slot[0] = ip->pages;
+        root->count = 1;
+        ip->pages = root;
+        ip->pheight++;
+    }
+    n = ip->pages;
+    for (h = ip->pheight; h > 1; h--) {
+        s = &n->slot[RADIX_SLOT(index, h)];
+        if (*s == 0) {
+            *s = node_alloc();
+            n->count++;
+        }
+        n = *s;
+    }
+    n->slot[RADIX_SLOT(index, 1)] = pg;
+    n->count++;
+}
+
+/* Remove the page at index, and the nodes that leaves empty. */
+static void
+radix_delete(struct inode* ip, uint32_t index)
+{
+    struct radix_node* path[32 / RADIX_SHIFT + 2];
+    int h;
+
+    path[ip->pheight] = ip->pages;
+    for (h = ip->pheight; h > 1; h--)
+        path[h - 1] = path[h]->slot[RADIX_SLOT(index, h)];
+    for (h = 1; h <= ip->pheight; h++) {
+        path[h]->slot[RADIX_SLOT(index, h)] = 0;
+        if (--path[h]->count > 0)
+            return;
+        node_free(path[h]);
+    }
+    ip->pages = 0;
+    ip->pheight = 0;
+}
+
+/* Free the nodes of a subtree of height h, and the pages under it. */
+static void
+radix_free(struct radix_node* n, int h)
+{
+    struct page* pg;
+    int i;
+
+    for (i = 0; i < RADIX_SLOTS; i++) {
+        if (n->slot[i] == 0)
+            continue;
+        if (h > 1) {
+            radix_free(n->slot[i], h - 1);
+            continue;
+        }
+        pg = n->slot[i];
+        if (pg->ref)
+            panic("pdrop: page in use");
+        pg->ip = 0;
+        lru_remove(pg);
+        lru_insert(pg);
+    }
+    node_free(n);
+}
+
+void
+pcache_init()
+{
+    struct page* pg;
+    char* p;
+    int npage, perpage;
+
+    npage = MAX(free_page_count() / PCACHE_MEMFRAC, NPAGE);
+    initlock(&pcache.lock, "pcache");
+
+    /* Carve the page structures out of whole pages, then give each its data. */
+    perpage = PGSIZE / sizeof(struct page);
+    for (pg = 0; pcache.npage < npage; pg++, pcache.npage++) {
+        if (pcache.npage % perpage == 0) {
+            if ((p = kalloc()) == 0)
+                break;
+            pg = (struct page*)p;
+        }
+        if ((pg->data = kalloc()) == 0)
+            break;
+        pg->ip = 0;
+        pg->ref = 0;
+        lru_insert(pg);
+    }
+    if (pcache.npage < NPAGE)
+        panic("pcache_init: only %d pages", pcache.npage);
+
+    cprintf("pcache_init: %d pages\n", pcache.npage);
+}
+
+/*
+ * Return page index of ip, referenced.  A page that was not cached
+ * is recycled from the least recently used one, and has no valid blocks.
+ * Caller must hold ip->lock.
+ */
+struct page*
+pget(struct inode* ip, uint32_t index)
+{
+    struct page* pg;
+
+    acquire(&pcache.lock);
+    if ((pg = radix_lookup(ip, index)) != 0) {
+        pg->ref++;
+        pcache.hit++;
+        release(&pcache.lock);
+        return pg;
+    }
+    pcache.miss++;
+
+    for (pg = pcache.mru->prev; pg->ref; pg = pg->prev) {
+        if (pg == pcache.mru)
+            panic("pget: no pages");
+    }
+    if (pg->ip) {
+        if (pg->dirty)
+            panic("pget: dirty page");
+        radix_delete(pg->ip, pg->index);
+        pcache.evict++;
+    }
+    pg->ip = ip;
+    pg->index = index;
+    pg->valid = 0;
+    pg->dirty = 0;
+    pg->ref = 1;
+    radix_insert(ip, index, pg);
+    release(&pcache.lock);
+    return pg;
+}
+
+/*
+ * Return the valid blocks of page index of ip, 0 if it is not cached.
+ * Caller must hold ip->lock.
+ */
+int
+pvalid(struct inode* ip, uint32_t index)
+{
+    struct page* pg;
+    int valid;
+
+    acquire(&pcache.lock);
+    pg = radix_lookup(ip, index);
+    valid = pg ? pg->valid : 0;
+    release(&pcache.lock);
+    return valid;
+}
+
+/* Drop a reference to pg, which becomes the most recently used page. */
+void
+pput(struct page* pg)
+{
+    acquire(&pcache.lock);
+    if (--pg->ref == 0) {
+        lru_remove(pg);
+        lru_insert(pg);
+    }
+    release(&pcache.lock);
+}
+
+/* Forget all pages of ip.  None may be in use. */
+void
+pdrop(struct inode* ip)
+{
+    acquire(&pcache.lock);
+    if (ip->pages)
+        radix_free(ip->pages, ip->pheight);
+    ip->pages = 0;
+    ip->pheight = 0;
+    release(&pcache.lock);
+}
+
+/* Report page cache statistics. */
+void
+pstat(struct pstat* st)
+{
+    acquire(&pcache.lock);
+    st->npage = pcache.npage;
+    st->hit = pcache.hit;
+    st->miss = pcache.miss;
+    st->evict = pcache.evict;
+    release(&pcache.lock);
+}
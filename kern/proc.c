@@ -9,6 +9,8 @@
 #include "sd.h"
 #include "file.h"
 #include "log.h"
+#include "blk.h"
+#include "ramdisk.h"
 
 
 struct {
@@ -161,6 +163,35 @@ void user_idle_init()
     p->sz = PGSIZE;
 }
 
+/*
+ * Start a kernel thread running fn(), which must never return.
+ * It has an empty user address space and never leaves the kernel.
+ */
+void
+kthread_create(void (*fn)(), char* name)
+{
+    extern void kthread_trampoline();
+    struct proc* p;
+
+    if ((p = proc_alloc()) == 0)
+        panic("kthread_create: cannot allocate a process");
+    if ((p->pgdir = pgdir_init()) == 0)
+        panic("kthread_create: cannot allocate a pagetable");
+
+    p->context->x19 = (uint64_t)fn;
+    p->context->x30 = (uint64_t)kthread_trampoline;
+    strncpy(p->name, name, sizeof(p->name));
+    p->state = RUNNABLE;
+}
+
+/* First code run by a kernel thread, called by kthread_trampoline. */
+void
+kthread_main(void (*fn)())
+{
+    release(&ptable.lock);
+    fn();
+    panic("kthread_main: %s returned", thisproc()->name);
+}
 
 /*
  * Per-CPU process scheduler
@@ -236,7 +267,11 @@ forkret()
     release(&ptable.lock);
 
     if (thiscpu->proc->pid == 1) {
+#ifdef RAMDISK_ROOT
+        ramdisk_load(SDDEV + 2);
+#endif
         initlog(ROOTDEV);
+        iinit(ROOTDEV);
         // sd_test();
         cprintf("init the log successfully\n");
 #ifdef TEST_FILE_SYSTEM
@@ -0,0 +1,94 @@
+/*
+ * RAM disk.
+ *
+ * Keeps the blocks of block device RAMDEV in kernel pages, found
+ * through one page of page pointers.  Requests are copied and
+ * completed right away in the context that kicks the queue.
+ */
+
+#include "types.h"
+#include "mmu.h"
+#include "string.h"
+#include "console.h"
+#include "kalloc.h"
+#include "buf.h"
+#include "blk.h"
+#include "fs.h"
+#include "file.h"
+#include "ramdisk.h"
+
+#define BPP         (PGSIZE / BSIZE)    /* Blocks per page */
+#define MAXPAGES    (PGSIZE / sizeof(char*))
+
+static struct {
+    char** page;
+    uint32_t nblocks;
+} ram;
+
+static char*
+ram_block(uint32_t blockno)
+{
+    return ram.page[blockno / BPP] + blockno % BPP * BSIZE;
+}
+
+static void
+ram_kick(struct blkdev* d)
+{
+    struct buf* b, * next;
+
+    while ((b = blk_dispatch(d)) != 0) {
+        for (; b; b = next) {
+            next = b->qnext;
+            if (b->flags & B_DIRTY)
+                memmove(ram_block(blk_sector(b)), b->data, BSIZE);
+            else
+                memmove(b->data, ram_block(blk_sector(b)), BSIZE);
+            blk_done(b);
+        }
+    }
+}
+
+static const struct blkops ram_ops = { .kick = ram_kick };
+
+/* Allocate a zeroed RAM disk of nblocks blocks. */
+void
+ramdisk_init(uint32_t nblocks)
+{
+    uint32_t i, npage = (nblocks + BPP - 1) / BPP;
+
+    if (npage > MAXPAGES)
+        panic("ramdisk_init: %d blocks too many", nblocks);
+    if ((ram.page = (char**)kalloc()) == 0)
+        panic("ramdisk_init: out of memory");
+    memset(ram.page, 0, PGSIZE);
+    for (i = 0; i < npage; i++) {
+        if ((ram.page[i] = kalloc()) == 0)
+            panic("ramdisk_init: out of memory");
+        memset(ram.page[i], 0, PGSIZE);
+    }
+    ram.nblocks = nblocks;
+    blk_register(RAMDEV, "ram", &ram_ops, 0, nblocks, RAMDISK_MAXRUN);
+}
+
+/*
+ * Copy the file system on device src into the RAM disk.
+ * Must be called from a process, as it reads src through the cache.
+ */
+void
+ramdisk_load(int src)
+{
+    struct superblock sb;
+    struct buf* b;
+    uint32_t i, n;
+
+    readsb(src, &sb);
+    if (sb.size > ram.nblocks)
+        panic("ramdisk_load: %d blocks do not fit in %d", sb.size, ram.nblocks);
+    n = sb.size;
+    for (i = 0; i < n; i++) {
+        b = bread(src, i);
+        memmove(ram_block(i), b->data, BSIZE);
+        brelse(b);
+    }
+    cprintf("ramdisk: loaded %d blocks from dev %d\n", n, src);
+}
@@ -18,12 +18,13 @@
 #include "arm.h"
 #include "peripherals/gpio.h"
 #include "peripherals/mbox.h"
+#include "peripherals/dma.h"
 #include "console.h"
 
 #include "proc.h"
 #include "buf.h"
 #include "spinlock.h"
-#include "list.h"
+#include "blk.h"
 // Private functions.
 static void sd_start(struct buf* b);
 static void sd_delayus(uint32_t cnt);
@@ -34,6 +35,8 @@ static int sdSendCommand(int index);
 static int sdSendCommandA(int index, int arg);
 static int sdWaitForInterrupt(unsigned int mask);
 static int sdWaitForData();
+static void sdLogMode();
+static int sdSetClock(int freq);
 int fls_long(unsigned long x);
 
 // EMMC registers
@@ -122,6 +125,8 @@ int fls_long(unsigned long x);
 
 #define FREQ_SETUP           400000  // 400 Khz
 #define FREQ_NORMAL        25000000  // 25 Mhz
+#define FREQ_HIGH          50000000  // 50 Mhz, high speed mode
+#define FREQ_BASE_DEFAULT  41666666  // Base clock if the mailbox fails
 
 // CONTROL2 values
 #define C2_VDD_18        0x00080000
@@ -245,7 +250,7 @@ static EMMCCommand sdCommandTable[] =
   { "ALL_SEND_CID" , 0x02000000 | CMD_RSPNS_136                            , RESP_R2I, RCA_NO  ,0},
   { "SEND_REL_ADDR", 0x03000000 | CMD_RSPNS_48                             , RESP_R6 , RCA_NO  ,0},
   { "SET_DSR"      , 0x04000000 | CMD_RSPNS_NO                             , RESP_NO , RCA_NO  ,0},
-  { "SWITCH_FUNC"  , 0x06000000 | CMD_RSPNS_48                             , RESP_R1 , RCA_NO  ,0},
+  { "SWITCH_FUNC"  , 0x06000000 | CMD_RSPNS_48 | CMD_IS_DATA | TM_DAT_DIR_CH, RESP_R1 , RCA_NO  ,0},
   { "CARD_SELECT"  , 0x07000000 | CMD_RSPNS_48B                            , RESP_R1b, RCA_YES ,0},
   { "SEND_IF_COND" , 0x08000000 | CMD_RSPNS_48                             , RESP_R7 , RCA_NO  ,100},
   { "SEND_CSD"     , 0x09000000 | CMD_RSPNS_136                            , RESP_R2S, RCA_YES ,0},
@@ -256,12 +261,12 @@ static EMMCCommand sdCommandTable[] =
   { "GO_INACTIVE"  , 0x0F000000 | CMD_RSPNS_NO                             , RESP_NO , RCA_YES ,0},
   { "SET_BLOCKLEN" , 0x10000000 | CMD_RSPNS_48                             , RESP_R1 , RCA_NO  ,0},
   { "READ_SINGLE"  , 0x11000000 | CMD_RSPNS_48 | CMD_IS_DATA | TM_DAT_DIR_CH, RESP_R1 , RCA_NO  ,0},
-  { "READ_MULTI"   , 0x12000000 | CMD_RSPNS_48 | TM_MULTI_DATA | TM_DAT_DIR_CH, RESP_R1 , RCA_NO  ,0},
+  { "READ_MULTI"   , 0x12000000 | CMD_RSPNS_48 | TM_MULTI_DATA | TM_DAT_DIR_CH | TM_AUTO_CMD12, RESP_R1 , RCA_NO  ,0},
   { "SEND_TUNING"  , 0x13000000 | CMD_RSPNS_48                             , RESP_R1 , RCA_NO  ,0},
   { "SPEED_CLASS"  , 0x14000000 | CMD_RSPNS_48B                            , RESP_R1b, RCA_NO  ,0},
   { "SET_BLOCKCNT" , 0x17000000 | CMD_RSPNS_48                             , RESP_R1 , RCA_NO  ,0},
   { "WRITE_SINGLE" , 0x18000000 | CMD_RSPNS_48 | CMD_IS_DATA | TM_DAT_DIR_HC, RESP_R1 , RCA_NO  ,0},
-  { "WRITE_MULTI"  , 0x19000000 | CMD_RSPNS_48 | TM_MULTI_DATA | TM_DAT_DIR_HC, RESP_R1 , RCA_NO  ,0},
+  { "WRITE_MULTI"  , 0x19000000 | CMD_RSPNS_48 | TM_MULTI_DATA | TM_DAT_DIR_HC | TM_AUTO_CMD12, RESP_R1 , RCA_NO  ,0},
   { "PROGRAM_CSD"  , 0x1B000000 | CMD_RSPNS_48                             , RESP_R1 , RCA_NO  ,0},
   { "SET_WRITE_PR" , 0x1C000000 | CMD_RSPNS_48B                            , RESP_R1b, RCA_NO  ,0},
   { "CLR_WRITE_PR" , 0x1D000000 | CMD_RSPNS_48B                            , RESP_R1b, RCA_NO  ,0},
@@ -490,6 +495,11 @@ static int sdHostVer = 0;
 static int sdDebug = 0;
 static int sdBaseClock;
 
+// Negotiated bus mode.
+static int sdBusWidth = 1;
+static int sdHighSpeed = 0;
+static int sdClock;
+
 #define MBX_PROP_CLOCK_EMMC 1
 
 /*
@@ -500,9 +510,33 @@ static int sdBaseClock;
  * See https://en.wikipedia.org/wiki/Master_boot_record
  */
 
-struct buf sdque;
 struct spinlock sdlock;
 
+/*
+ * The transfer in flight covers the run of sdxfer.n bufs starting at
+ * sdxfer.head, chained through qnext, as handed out by blk_dispatch.
+ * They address consecutive blocks in the same direction.
+ * Data is moved by DMA channel SD_DMA_CHAN through one control block
+ * per buffer; the transfer is complete once both the EMMC has raised
+ * DATA_DONE and the DMA engine has reached the end of the chain.
+ */
+#define XFER_DATA   0x1     /* Waiting for EMMC DATA_DONE */
+#define XFER_DMA    0x2     /* Waiting for DMA END */
+
+static struct {
+    struct buf* head;
+    int n;
+    int write;
+    int pending;
+} sdxfer;
+
+static struct dma_cb sdcb[SD_MAXBLKS];
+
+static void sd_kick(struct blkdev* d);
+
+static const struct blkops sd_ops = { .kick = sd_kick };
+static struct blkdev* sddisk;
+
 void
 sd_init()
 {
@@ -512,16 +546,17 @@ sd_init()
      */
      /* TODO: Your code here. */
     static struct buf mbr;
-    uint32_t* LBA;
-    uint32_t* NUM;
-    uint8_t* end;
 
     initlock(&sdlock, "sdlock");
-    list_initialize(&sdque);
+
+    *DMA_ENABLE |= 1 << SD_DMA_CHAN;
+    *DMA_CS(SD_DMA_CHAN) = DMA_CS_RESET;
 
     sdInit();
     assert(sdCard.init);
 
+    sddisk = blk_register(SDDEV, "sd", &sd_ops, 0, sdCard.capacity / BSIZE, SD_MAXBLKS);
+
     /*
      * Read and parse 1st block (MBR) and collect whatever
      * information you wan.
@@ -532,28 +567,23 @@ sd_init()
 
      /* TODO: Your code here. */
 
+    mbr.dev = SDDEV;
     mbr.blockno = 0;
     mbr.flags = 0;
     mbr.qnext = NULL;
 
     sd_start(&mbr);
 
-    sdWaitForInterrupt(INT_READ_RDY);
-
-    uint32_t* intbuf = (uint32_t*)mbr.data;
-    for (int done = 0; done < 128; ) {
-        intbuf[done++] = *EMMC_DATA;
-        // cprintf("%d %d\n", intbuf[done - 1], done - 1);
-    }
+    // Interrupts are not taken yet, so poll for both ends of the transfer.
     sdWaitForInterrupt(INT_DATA_DONE);
+    while (!(*DMA_CS(SD_DMA_CHAN) & DMA_CS_END))
+        ;
+    *DMA_CS(SD_DMA_CHAN) = DMA_CS_END | DMA_CS_INT;
+    *EMMC_INTERRUPT = *EMMC_INTERRUPT;
+    dccivac(mbr.data, BSIZE);
+    sdxfer.head = 0;
 
-    //no.471-474 475-478 bytes 4bytes
-    LBA = *(uint32_t*)(mbr.data + 0x1CE + 0x8);
-    NUM = *(uint32_t*)(mbr.data + 0x1CE + 0xC);
-    // end = mbr.data[511];
-    cprintf("0x%x\n", LBA);
-    cprintf("0x%x\n", NUM);
-    // cprintf("0x%x\n", end);
+    blk_add_partitions(sddisk, mbr.data);
 }
 
 static void
@@ -563,17 +593,30 @@ sd_delayus(uint32_t c)
     delayus(c * 3);
 }
 
-/* Start the request for b. Caller must hold sdlock. */
+/*
+ * Start the run of requests chained from b through qnext, which
+ * address consecutive sectors in the same direction.
+ * Runs of more than one block use READ_MULTI/WRITE_MULTI with the block
+ * count in BLKSIZECNT and an automatic CMD12 to stop the transfer.
+ * The data itself is moved by DMA, paced by the EMMC data request line.
+ * Caller must hold sdlock.
+ */
 static void
 sd_start(struct buf* b)
 {
     // Address is different depending on the card type.
     // HC pass address as block #.
     // SC pass address straight through.
-    int bno = sdCard.type == SD_TYPE_2_HC ? b->blockno : b->blockno << 9;
+    int bno = sdCard.type == SD_TYPE_2_HC ? blk_sector(b) : blk_sector(b) << 9;
     int write = b->flags & B_DIRTY;
+    int n = 1, k;
+    struct buf* p;
+
+    for (p = b; p->qnext; p = p->qnext)
+        n++;
+    assert(n <= SD_MAXBLKS);
 
-    // cprintf("- sd start: cpu %d, flag 0x%x, bno %d, write=%d\n", cpuid(), b->flags, bno, write);
+    // cprintf("- sd start: cpu %d, flag 0x%x, bno %d, write=%d, n=%d\n", cpuid(), b->flags, bno, write, n);
 
     disb();
     // Ensure that any data operation has completed before doing the transfer.
@@ -581,115 +624,139 @@ sd_start(struct buf* b)
     disb();
 
     // Work out the status, interrupt and command values for the transfer.
-    int cmd = write ? IX_WRITE_SINGLE : IX_READ_SINGLE;
-
-    int resp;
-    *EMMC_BLKSIZECNT = 512;
+    int cmd;
+    if (n > 1)
+        cmd = write ? IX_WRITE_MULTI : IX_READ_MULTI;
+    else
+        cmd = write ? IX_WRITE_SINGLE : IX_READ_SINGLE;
+
+    sdxfer.head = b;
+    sdxfer.n = n;
+    sdxfer.write = write;
+    sdxfer.pending = XFER_DATA | XFER_DMA;
+
+    // Chain one control block per buffer, interrupting after the last one.
+    for (p = b, k = 0; k < n; p = p->qnext, k++) {
+        struct dma_cb* cb = &sdcb[k];
+        if (write) {
+            cb->ti = DMA_TI_SRC_INC | DMA_TI_DEST_DREQ;
+            cb->source_ad = BUS_ADDR(p->data);
+            cb->dest_ad = BUS_PERIPH(EMMC_DATA);
+        } else {
+            cb->ti = DMA_TI_DEST_INC | DMA_TI_SRC_DREQ;
+            cb->source_ad = BUS_PERIPH(EMMC_DATA);
+            cb->dest_ad = BUS_ADDR(p->data);
+        }
+        cb->ti |= DMA_TI_PERMAP(DMA_DREQ_EMMC) | DMA_TI_WAIT_RESP;
+        cb->txfr_len = BSIZE;
+        cb->stride = 0;
+        cb->nextconbk = k + 1 < n ? BUS_ADDR(&sdcb[k + 1]) : 0;
 
-    if ((resp = sdSendCommandA(cmd, bno))) {
-        panic("* EMMC send command error.");
+        // Push dirty lines out before a write, drop stale ones before a read.
+        dccivac(p->data, BSIZE);
     }
+    sdcb[n - 1].ti |= DMA_TI_INTEN;
+    dccivac(sdcb, n * sizeof(sdcb[0]));
+    disb();
 
-    int done = 0;
-    uint32_t* intbuf = (uint32_t*)b->data;
-    asserts((((int64_t)b->data) & 0x03) == 0, "Only support word-aligned buffers. ");
+    *EMMC_BLKSIZECNT = (n << 16) | 512;
+    *DMA_CONBLK_AD(SD_DMA_CHAN) = BUS_ADDR(sdcb);
+    *DMA_CS(SD_DMA_CHAN) = DMA_CS_ACTIVE | DMA_CS_WAIT_WRITES;
 
-    if (write) {
-        // Wait for ready interrupt for the next block.
-        if ((resp = sdWaitForInterrupt(INT_WRITE_RDY))) {
-            panic("* EMMC ERROR: Timeout waiting for ready to write\n");
-            // return sdDebugResponse(resp);
-        }
-        asserts(!*EMMC_INTERRUPT, "%d ", *EMMC_INTERRUPT);
-        while (done < 128) *EMMC_DATA = intbuf[done++];
+    if (sdSendCommandA(cmd, bno)) {
+        panic("* EMMC send command error.");
     }
-
-
 }
 
-/* The interrupt handler. */
+/*
+ * The interrupt handler, for both the EMMC and its DMA channel.
+ * It only records which half of the transfer has finished; the data
+ * is already in place when both have.
+ */
 void
 sd_intr()
 {
-    /* TODO: Your code here. */
-
-    /* Hint: Example pseudocode is provided as below. */
     acquire(&sdlock);
-    if (list_empty(&sdque)) {
-        cprintf("sd receive redundent interrupt 0x%x, omitted.\n", *EMMC_INTERRUPT);
-    }
-    else {
-        int i = *EMMC_INTERRUPT;
-        // FIXME: Restart when failed
-        asserts((i & INT_DATA_DONE) || (i & INT_READ_RDY), "unexpected sd intr");
 
-        *EMMC_INTERRUPT = i; // Clear interrupt.
-        disb();
-
-        struct buf* b = list_front(&sdque);
-        int write = b->flags & B_DIRTY;
-        if (!((write && i == INT_DATA_DONE) || (!write && INT_READ_RDY))) {
-            sd_start(b);
-            // FIXME: don't panic
-            cprintf("sd intr unexpected: 0x%x, restarted.\n", i);
-        }
-        else {
-            if (!write) {
-                uint32_t* intbuf = (uint32_t*)b->data;
-                for (int done = 0; done < 128; )
-                    intbuf[done++] = *EMMC_DATA;
-                sdWaitForInterrupt(INT_DATA_DONE);
-            }
+    int i = *EMMC_INTERRUPT;
+    int cs = *DMA_CS(SD_DMA_CHAN);
 
-            b->flags |= B_VALID;
-            b->flags &= ~B_DIRTY;
-            wakeup(b);
+    // Clear interrupts.
+    *EMMC_INTERRUPT = i;
+    if (cs & DMA_CS_INT)
+        *DMA_CS(SD_DMA_CHAN) = DMA_CS_END | DMA_CS_INT;
+    disb();
 
-            list_pop_front(&sdque);
-            if (!list_empty(&sdque))
-                sd_start(list_front(&sdque));
+    if (!sdxfer.head) {
+        cprintf("sd receive redundent interrupt 0x%x, omitted.\n", i);
+    }
+    else if ((i & INT_ERROR_MASK) || (cs & DMA_CS_ERROR)) {
+        *DMA_CS(SD_DMA_CHAN) = DMA_CS_RESET;
+        disb();
+        sd_start(sdxfer.head);
+        cprintf("sd intr unexpected: 0x%x, dma 0x%x, restarted.\n", i, cs);
+    }
+    else {
+        if (i & INT_DATA_DONE)
+            sdxfer.pending &= ~XFER_DATA;
+        if (cs & DMA_CS_END)
+            sdxfer.pending &= ~XFER_DMA;
+
+        if (!sdxfer.pending) {
+            struct buf* b = sdxfer.head, * next;
+            for (int k = 0; k < sdxfer.n; k++, b = next) {
+                next = b->qnext;
+                // Lines may have been fetched speculatively during the DMA.
+                if (!sdxfer.write)
+                    dccivac(b->data, BSIZE);
+                blk_done(b);
+            }
+            if ((sdxfer.head = blk_dispatch(sddisk)) != 0)
+                sd_start(sdxfer.head);
         }
     }
     release(&sdlock);
+}
 
+/* Start the next run from the block request layer if the card is idle. */
+static void
+sd_kick(struct blkdev* d)
+{
+    acquire(&sdlock);
+    if (!sdxfer.head && (sdxfer.head = blk_dispatch(d)) != 0)
+        sd_start(sdxfer.head);
+    release(&sdlock);
 }
 
 /*
- * Sync buf with disk.
- * If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
- * Else if B_VALID is not set, read buf from disk, set B_VALID.
+ * Sequential benchmark over b[0..n), queued batch requests at a time.
+ * With batch 1 every block is its own command.
  */
-void
-sdrw(struct buf* b)
+static void
+sd_bench(struct buf* b, int n, int write, int batch)
 {
-    /* TODO: Your code here. */
-    // add to the list, if list is empty, then use sd_start
-    // then sleep, use loop to check whether buf flag is modified, if modified, then break
-    int flag;
-    flag = list_empty(&sdque);
-    list_push(b, &sdque);
-
-    // cprintf("sdbegin");
-
-    acquire(&sdlock);
-
-
-    if (flag) {
-        sd_start(list_front(&sdque));
-    }
-
+    static struct buf* bv[SD_MAXBLKS];
+    int mb = (n * BSIZE) >> 20;
+    int64_t f, t;
+    asm volatile ("mrs %[freq], cntfrq_el0" : [freq] "=r"(f));
 
-    while (1) {
-        sleep((void*)b, &sdlock);
-        //flags = 100 -> 010
-        // cprintf("!!@#!@");
-        if ((b->flags & B_VALID) && (~b->flags & B_DIRTY)) {
-            break;
+    disb();
+    t = timestamp();
+    disb();
+    for (int i = 0; i < n; i += batch) {
+        int k;
+        for (k = 0; k < batch && i + k < n; k++) {
+            b[i + k].flags = write ? B_DIRTY : 0;
+            b[i + k].blockno = i + k;
+            bv[k] = &b[i + k];
         }
-
+        blkrwv(bv, k);
     }
-    if (holding(&sdlock))
-        release(&sdlock);
+    disb();
+    t = timestamp() - t;
+    disb();
+    cprintf("- %s %lldB (%lldMB) %d blocks/cmd, t: %lld cycles, speed: %lld.%lld MB/s\n",
+        write ? "write" : "read", n * BSIZE, mb, batch, t, mb * f / t, (mb * f * 10 / t) % 10);
 }
 
 /* SD card test and benchmark. */
@@ -698,11 +765,9 @@ sd_test()
 {
     static struct buf b[1 << 11];
     int n = sizeof(b) / sizeof(b[0]);
-    int mb = (n * BSIZE) >> 20;
-    assert(mb);
-    int64_t f, t;
-    asm volatile ("mrs %[freq], cntfrq_el0" : [freq] "=r"(f));
+    assert((n * BSIZE) >> 20);
     cprintf("- sd test: begin nblocks %d\n", n);
+    sdLogMode();
 
     cprintf("- sd check rw...\n");
     // Read/write test
@@ -712,59 +777,34 @@ sd_test()
         b[0].blockno = i;
 
 
-        sdrw(&b[0]);
+        blkrw(&b[0]);
 
         // Write some value.
         b[i].flags = B_DIRTY;
         b[i].blockno = i;
         for (int j = 0; j < BSIZE; j++)
             b[i].data[j] = i * j & 0xFF;
-        sdrw(&b[i]);
+        blkrw(&b[i]);
 
         memset(b[i].data, 0, sizeof(b[i].data));
         // Read back and check
         b[i].flags = 0;
-        sdrw(&b[i]);
+        blkrw(&b[i]);
         for (int j = 0; j < BSIZE; j++)
         {
             assert(b[i].data[j] == (i * j & 0xFF));
         }
         // Restore previous value.
         b[0].flags = B_DIRTY;
-        sdrw(&b[0]);
-
-    }
+        blkrw(&b[0]);
 
-    // Read benchmark
-    disb();
-    t = timestamp();
-    disb();
-    for (int i = 0; i < n; i++) {
-        b[i].flags = 0;
-        b[i].blockno = i;
-        sdrw(&b[i]);
     }
-    disb();
-    t = timestamp() - t;
-    disb();
-    cprintf("- read %lldB (%lldMB), t: %lld cycles, speed: %lld.%lld MB/s\n",
-        n * BSIZE, mb, t, mb * f / t, (mb * f * 10 / t) % 10);
 
-    // Write benchmark
-    disb();
-    t = timestamp();
-    disb();
-    for (int i = 0; i < n; i++) {
-        b[i].flags = B_DIRTY;
-        b[i].blockno = i;
-        sdrw(&b[i]);
-    }
-    disb();
-    t = timestamp() - t;
-    disb();
-
-    cprintf("- write %lldB (%lldMB), t: %lld cycles, speed: %lld.%lld MB/s\n",
-        n * BSIZE, mb, t, mb * f / t, (mb * f * 10 / t) % 10);
+    // Sequential benchmarks, single-block then multi-block commands.
+    sd_bench(b, n, 0, 1);
+    sd_bench(b, n, 1, 1);
+    sd_bench(b, n, 0, SD_MAXBLKS);
+    sd_bench(b, n, 1, SD_MAXBLKS);
 }
 
 static int
@@ -1072,6 +1112,77 @@ sdReadSCR()
     return SD_OK;
 }
 
+/*
+ * Send SWITCH_FUNC (CMD6) with arg and read the 64-byte switch
+ * status it returns.  The status is big-endian: byte 0 holds bits 511:504.
+ */
+static int
+sdSwitchFunc(int arg, uint8_t* status)
+{
+    uint32_t* w = (uint32_t*)status;
+    int resp;
+
+    if (sdWaitForData()) return SD_TIMEOUT;
+
+    *EMMC_BLKSIZECNT = (1 << 16) | 64;
+    if ((resp = sdSendCommandA(IX_SWITCH_FUNC, arg))) return sdDebugResponse(resp);
+
+    if ((resp = sdWaitForInterrupt(INT_READ_RDY))) {
+        cprintf("* ERROR EMMC: Timeout waiting for switch status\n");
+        return sdDebugResponse(resp);
+    }
+
+    // Allow maximum of 100ms for the read operation.
+    int numRead = 0, count = 100000;
+    while (numRead < 16) {
+        if (*EMMC_STATUS & SR_READ_AVAILABLE)
+            w[numRead++] = *EMMC_DATA;
+        else {
+            sd_delayus(1);
+            if (--count == 0) break;
+        }
+    }
+    if (numRead != 16) {
+        cprintf("* EMMC: Reading switch status, only read %d words\n", numRead);
+        return SD_TIMEOUT;
+    }
+    return sdWaitForInterrupt(INT_DATA_DONE);
+}
+
+/*
+ * Switch the card to high speed (function 1 of group 1) with CMD6,
+ * then the host to high speed timing at FREQ_HIGH.
+ * On failure the card is left at default speed and FREQ_NORMAL.
+ */
+static int
+sdSwitchHighSpeed()
+{
+    static uint8_t status[64] __attribute__((aligned(4)));
+    int resp;
+
+    // CMD6 appeared in version 1.10 of the spec.
+    if ((sdCard.scr[0] & SCR_SD_SPEC) == SCR_SD_SPEC_1_101) return SD_ERROR;
+
+    // Mode 0 checks, function group 1 support bits are 415:400.
+    if ((resp = sdSwitchFunc(0x00FFFFF1, status))) return resp;
+    if (!(status[13] & 0x02)) return SD_ERROR;
+
+    // Mode 1 switches, the selected function of group 1 is in bits 379:376.
+    if ((resp = sdSwitchFunc(0x80FFFFF1, status))) return resp;
+    if ((status[16] & 0x0f) != 1) return SD_ERROR;
+
+    // The card switches within 8 clocks of the end of the status.
+    sd_delayus(10);
+    *EMMC_CONTROL0 |= C0_HCTL_HS_EN;
+    if ((resp = sdSetClock(FREQ_HIGH))) {
+        *EMMC_CONTROL0 &= ~C0_HCTL_HS_EN;
+        sdSetClock(FREQ_NORMAL);
+        return resp;
+    }
+    sdHighSpeed = 1;
+    return SD_OK;
+}
+
 int
 fls_long(unsigned long x)
 {
@@ -1113,29 +1224,27 @@ roundup_pow_of_two(unsigned long x)
 static uint32_t
 sdGetClockDivider(uint32_t freq)
 {
-    uint32_t divisor;
-    // Pi SD frequency is always 41.66667Mhz on baremetal
-    uint32_t closest = 41666666 / freq;
-
-    // Get the raw shiftcount
-    uint32_t shiftcount = fls_long(closest - 1);
-
-    // Note the offset of shift by 1 (look at the spec)
-    if (shiftcount > 0) shiftcount--;
-
-    // It's only 8 bits maximum on HOST_SPEC_V2
-    if (shiftcount > 7) shiftcount = 7;
-    // Version 3 take closest
-    if (sdHostVer > HOST_SPEC_V2) divisor = closest;
-    // Version 2 take power 2
-    else divisor = (1 << shiftcount);
-
-    if (divisor <= 2) {     // Too dangerous to go for divisor 1 unless you test
-        divisor = 2;        // You can't take divisor below 2 on slow cards
-        shiftcount = 0;     // Match shift to above just for debug notification
+    // The SD clock is base / (2 * N) for a divider N, N = 0 giving the base clock.
+    // Host spec v3 takes any 10-bit N, older hosts a power of 2 up to 0x80.
+    uint32_t base = sdBaseClock > 0 ? sdBaseClock : FREQ_BASE_DEFAULT;
+    uint32_t divisor = 0, shiftcount = 0;
+
+    if (freq < base) {
+        // Round up, so that the card is never clocked above freq.
+        divisor = (base + 2 * freq - 1) / (2 * freq);
+        if (sdHostVer > HOST_SPEC_V2) {
+            if (divisor > 0x3ff) divisor = 0x3ff;
+        }
+        else {
+            shiftcount = fls_long(divisor - 1);
+            if (shiftcount > 7) shiftcount = 7;
+            divisor = 1 << shiftcount;
+        }
     }
+    sdClock = divisor ? base / (2 * divisor) : base;
 
-    cprintf("- Divisor selected = %u, pow 2 shift count = %u\n", divisor, shiftcount);
+    cprintf("- Divisor selected = %u, pow 2 shift count = %u, clock %u Hz from base %u Hz\n",
+        divisor, shiftcount, sdClock, base);
     uint32_t hi = 0;
     if (sdHostVer > HOST_SPEC_V2)
         hi = (divisor & 0x300) >> 2;    // Only 10 bits on Hosts specs above 2
@@ -1215,7 +1324,8 @@ sdResetCard(int resetType)
     // *EMMC_IRPT_EN   = INT_ALL_MASK;
     // *EMMC_IRPT_MASK = INT_ALL_MASK;
     // Ignore INT_CMD_DONE and INT_WRITE_RDY.
-    *EMMC_IRPT_EN = 0xffffffff & (~INT_CMD_DONE) & (~INT_WRITE_RDY);
+    // Data is moved by DMA, so the ready interrupts are not wanted.
+    *EMMC_IRPT_EN = 0xffffffff & (~INT_CMD_DONE) & (~INT_WRITE_RDY) & (~INT_READ_RDY);
     *EMMC_IRPT_MASK = 0xffffffff;
     // printf("EMMC: Interrupt enable/mask registers: %08x %08x\n",*EMMC_IRPT_EN,*EMMC_IRPT_MASK);
     // printf("EMMC: Status: %08x, control: %08x %08x %08x\n",*EMMC_STATUS,*EMMC_CONTROL0,*EMMC_CONTROL1,*EMMC_CONTROL2);
@@ -1459,12 +1569,22 @@ sdInit()
 
     // Send APP_SET_BUS_WIDTH (ACMD6)
     // If supported, set 4 bit bus width and update the CONTROL0 register.
+    // Stay on 1 bit if the card refuses.
     if (sdCard.support & SD_SUPP_BUS_WIDTH_4) {
-        if ((resp = sdSendCommandA(IX_SET_BUS_WIDTH, sdCard.rca | 2)))
-            return sdDebugResponse(resp);
-        *EMMC_CONTROL0 |= C0_HCTL_DWITDH;
+        if ((resp = sdSendCommandA(IX_SET_BUS_WIDTH, sdCard.rca | 2))) {
+            sdDebugResponse(resp);
+            cprintf("- EMMC: 4 bit bus refused, staying on 1 bit.\n");
+        }
+        else {
+            *EMMC_CONTROL0 |= C0_HCTL_DWITDH;
+            sdBusWidth = 4;
+        }
     }
 
+    // Try high speed, falling back to default speed.
+    if (sdSwitchHighSpeed())
+        cprintf("- EMMC: high speed not available, staying at default speed.\n");
+
     // Send SET_BLOCKLEN (CMD16)
     // TODO: only needs to be sent for SDSC cards.  For SDHC and SDXC cards block length is fixed
     // at 512 anyway.
@@ -1472,6 +1592,7 @@ sdInit()
 
     // Print out the CID having got this far.
     sdParseCID();
+    sdLogMode();
 
     // Initialisation complete.
     sdCard.init = 1;
@@ -1483,6 +1604,14 @@ sdInit()
     return SD_CARD_CHANGED;
 }
 
+/* Log the negotiated bus width, speed mode and clock. */
+static void
+sdLogMode()
+{
+    cprintf("- EMMC: %d bit bus, %s speed, clock %d Hz\n",
+        sdBusWidth, sdHighSpeed ? "high" : "default", sdClock);
+}
+
 /* Parse CID. */
 static void
 sdParseCID()
@@ -311,7 +311,10 @@ const int (*syscall_table[NR_SYSCALL])() = {
     [SYS_exit] = sys_exit,
     [SYS_exit_group] = sys_exit,
 
+    [SYS_fdatasync] = sys_fsync,
     [SYS_fstat] = sys_fstat,
+    [SYS_fsync] = sys_fsync,
+    [SYS_getdents64] = (const int*)sys_getdents64,
     [SYS_gettid] = sys_gettid,
     [SYS_ioctl] = sys_ioctl,
 
@@ -321,11 +324,19 @@ const int (*syscall_table[NR_SYSCALL])() = {
     [SYS_newfstatat] = sys_fstatat,
     [SYS_openat] = sys_openat,
 
+    [SYS_pread64] = (const int*)sys_pread64,
+    [SYS_preadv] = (const int*)sys_preadv,
+    [SYS_pwrite64] = (const int*)sys_pwrite64,
+    [SYS_pwritev] = (const int*)sys_pwritev,
+
     [SYS_read] = (const int*)sys_read,
+    [SYS_readv] = (const int*)sys_readv,
     [SYS_rt_sigprocmask] = sys_sigprocmask,
 
     [SYS_sched_yield] = sys_yield,
+    [SYS_sendfile] = (const int*)sys_sendfile,
     [SYS_set_tid_address] = sys_gettid,
+    [SYS_sync] = sys_sync,
 
     [SYS_wait4] = sys_wait4,
     [SYS_write] = sys_write,
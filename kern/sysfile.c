@@ -18,11 +18,6 @@
 #include "file.h"
 #include "syscall.h"
 
-struct iovec {
-    void* iov_base;    /* Starting address. */
-    size_t iov_len;     /* Number of bytes to transfer. */
-};
-
 /*
  * Fetch the nth word-sized system call argument as a file descriptor
  * and return both the descriptor and the corresponding struct file.
@@ -104,26 +99,168 @@ sys_write()
     return filewrite(f, p, n);
 }
 
+/*
+ * Fetch the nth system call argument as a pointer to len bytes, and
+ * check that all of them lie within the process address space.
+ * Unlike argptr(), len is not truncated to an int.
+ */
+static int
+argbuf(int n, char** pp, uint64_t len)
+{
+    uint64_t base, sz = thisproc()->sz;
+
+    if (argint(n, &base) < 0 || base >= sz || base + len > sz || base + len < base)
+        return -1;
+    *pp = (char*)base;
+    return 0;
+}
+
+/*
+ * Fetch the nth system call argument as an array of cnt iovecs,
+ * and check that every buffer lies within the process address space.
+ */
+static int
+argiov(int n, uint64_t cnt, struct iovec** piov)
+{
+    struct iovec* iov;
+    uint64_t base, sz = thisproc()->sz;
+    int i;
+
+    if (cnt > NIOV || argptr(n, (char**)&iov, cnt * sizeof(struct iovec)) < 0)
+        return -1;
+    for (i = 0; i < cnt; i++) {
+        base = (uint64_t)iov[i].iov_base;
+        if (iov[i].iov_len && (base >= sz || base + iov[i].iov_len > sz ||
+            base + iov[i].iov_len < base))
+            return -1;
+    }
+    *piov = iov;
+    return 0;
+}
+
+ssize_t
+sys_readv()
+{
+    struct file* f;
+    uint64_t cnt;
+    struct iovec* iov;
+
+    if (argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, cnt, &iov) < 0)
+        return -1;
+    return filereadv(f, iov, cnt, &f->off);
+}
+
+/* Read at an offset, leaving the file offset alone. */
+ssize_t
+sys_pread64()
+{
+    struct file* f;
+    ssize_t n;
+    int64_t off;
+    struct iovec iov;
+
+    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0 ||
+        argbuf(1, (char**)&iov.iov_base, n) < 0 || off < 0)
+        return -1;
+    iov.iov_len = n;
+    return filereadv(f, &iov, 1, (size_t*)&off);
+}
 
+ssize_t
+sys_preadv()
+{
+    struct file* f;
+    uint64_t cnt;
+    int64_t off;
+    struct iovec* iov;
+
+    if (argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argint(3, &off) < 0 ||
+        argiov(1, cnt, &iov) < 0 || off < 0)
+        return -1;
+    return filereadv(f, iov, cnt, (size_t*)&off);
+}
+
+/* Write all buffers in one transaction when they fit, see filewritev(). */
 ssize_t
 sys_writev()
 {
-    /* TODO: Your code here. */
+    struct file* f;
+    uint64_t cnt;
+    struct iovec* iov;
+
+    if (argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argiov(1, cnt, &iov) < 0)
+        return -1;
+    return filewritev(f, iov, cnt, &f->off);
+}
 
+/* Write at an offset, leaving the file offset alone. */
+ssize_t
+sys_pwrite64()
+{
     struct file* f;
-    int64_t fd, iovcnt;
-    struct iovec* iov, * p;
-    if (argfd(0, &fd, &f) < 0 ||
-        argint(2, &iovcnt) < 0 ||
-        argptr(1, &iov, iovcnt * sizeof(struct iovec)) < 0) {
+    ssize_t n;
+    int64_t off;
+    struct iovec iov;
+
+    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0 ||
+        argbuf(1, (char**)&iov.iov_base, n) < 0 || off < 0)
         return -1;
-    }
+    iov.iov_len = n;
+    return filewritev(f, &iov, 1, (size_t*)&off);
+}
 
-    size_t tot = 0;
-    for (p = iov; p < iov + iovcnt; p++) {
-        tot += filewrite(f, p->iov_base, p->iov_len);
-    }
-    return tot;
+ssize_t
+sys_pwritev()
+{
+    struct file* f;
+    uint64_t cnt;
+    int64_t off;
+    struct iovec* iov;
+
+    if (argfd(0, 0, &f) < 0 || argint(2, &cnt) < 0 || argint(3, &off) < 0 ||
+        argiov(1, cnt, &iov) < 0 || off < 0)
+        return -1;
+    return filewritev(f, iov, cnt, (size_t*)&off);
+}
+
+/* Read a batch of directory entries, with type hints. */
+ssize_t
+sys_getdents64()
+{
+    struct file* f;
+    ssize_t n;
+    char* p;
+
+    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argbuf(1, &p, n) < 0)
+        return -1;
+    return filereaddir(f, p, n);
+}
+
+/*
+ * Copy from in_fd to out_fd in the kernel.  With an offset pointer,
+ * read from *offset on and update it, else from the offset of in_fd.
+ */
+ssize_t
+sys_sendfile()
+{
+    struct file* out, * in;
+    uint64_t offp, n;
+    int64_t* p;
+    size_t off;
+    ssize_t r;
+
+    if (argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 ||
+        argint(2, &offp) < 0 || argint(3, &n) < 0)
+        return -1;
+    if (offp == 0)
+        return filesend(out, in, &in->off, n);
+
+    if (argptr(2, (char**)&p, sizeof(*p)) < 0 || *p < 0)
+        return -1;
+    off = *p;
+    r = filesend(out, in, &off, n);
+    *p = off;
+    return r;
 }
 
 int
@@ -143,6 +280,25 @@ sys_close()
     return 0;
 }
 
+/* Commit every file system operation that has ended. */
+int
+sys_sync()
+{
+    log_sync();
+    return 0;
+}
+
+int
+sys_fsync()
+{
+    struct file* f;
+
+    if (argfd(0, 0, &f) < 0)
+        return -1;
+    log_sync();
+    return 0;
+}
+
 int
 sys_fstat()
 {
@@ -294,6 +450,7 @@ sys_openat()
     f->type = FD_INODE;
     f->ip = ip;
     f->off = 0;
+    memset(&f->ra, 0, sizeof(f->ra));
     f->readable = !(omode & O_WRONLY);
     f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
     return fd;
@@ -111,7 +111,7 @@ irq_init()
 {
     cprintf("irq_init: - irq init\n");
     clock_init();
-    put32(ENABLE_IRQS_1, AUX_INT);
+    put32(ENABLE_IRQS_1, AUX_INT | DMA_INT(SD_DMA_CHAN));
     put32(ENABLE_IRQS_2, VC_ARASANSDIO_INT);
     put32(GPU_INT_ROUTE, GPU_IRQ2CORE(0));
 }
@@ -127,14 +127,14 @@ interrupt(struct trapframe* tf)
     }
     else if (src & IRQ_TIMER) {
         clock_reset();
-        // clock();
+        clock();
     }
     else if (src & IRQ_GPU) {
         int p1 = get32(IRQ_PENDING_1), p2 = get32(IRQ_PENDING_2);
         if (p1 & AUX_INT) {
             uart_intr();
         }
-        else if (p2 & VC_ARASANSDIO_INT) {
+        else if ((p2 & VC_ARASANSDIO_INT) || (p1 & DMA_INT(SD_DMA_CHAN))) {
             sd_intr();
         }
         else {
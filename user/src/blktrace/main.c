@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../../../inc/blktrace.h"
+
+/*
+ * blktrace [-e | -d] [-q] [-l]
+ *
+ * Print the block I/O events recorded since the last run, one per line
+ * as "ticks dev action R/W sector+count", then the latency histograms
+ * of each disk.  -q skips the events, -l skips the histograms.
+ * Events are only recorded while tracing is on: -e turns it on, -d
+ * turns it off, before anything is printed.
+ */
+
+static struct blktrace_event ev[256];
+static struct blklat lat[4];
+
+static int
+opendev(char* path, int minor, int mode)
+{
+    int fd;
+
+    if ((fd = open(path, mode)) < 0) {
+        mknod(path, BLKTRACE_MAJOR, minor);
+        fd = open(path, mode);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "blktrace: cannot open %s\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void
+events()
+{
+    int fd, i, n;
+
+    fd = opendev("blktrace.ev", BLKTRACE_EVENTS, O_RDONLY);
+    while ((n = read(fd, ev, sizeof(ev))) > 0) {
+        for (i = 0; i < n / (int)sizeof(ev[0]); i++)
+            printf("%llu %d %c %c %u+%u\n", (unsigned long long)ev[i].ts,
+                   ev[i].dev, ev[i].action, ev[i].write ? 'W' : 'R',
+                   ev[i].sector, ev[i].nblk);
+    }
+    close(fd);
+}
+
+static void
+hist(char* what, uint64_t* h)
+{
+    int i, hi = -1;
+
+    for (i = 0; i < BLKLAT_NBUCKET; i++)
+        if (h[i])
+            hi = i;
+    printf("  %s\n", what);
+    for (i = 0; i <= hi; i++)
+        printf("    %8lu us %10llu\n", i ? 1ul << i : 0ul, (unsigned long long)h[i]);
+}
+
+static void
+latency()
+{
+    int fd, i, n;
+    struct blklat* l;
+
+    fd = opendev("blktrace.lat", BLKTRACE_LAT, O_RDONLY);
+    n = read(fd, lat, sizeof(lat)) / sizeof(lat[0]);
+    close(fd);
+    if (n > 0 && lat[0].lost)
+        printf("%llu events lost\n", (unsigned long long)lat[0].lost);
+    for (i = 0; i < n; i++) {
+        l = &lat[i];
+        if (!l->n)
+            continue;
+        printf("%s (dev %u): %llu requests, avg queue %llu us, avg device %llu us\n",
+               l->name, l->dev, (unsigned long long)l->n,
+               (unsigned long long)(l->sum_queue / l->n),
+               (unsigned long long)(l->sum_device / l->n));
+        hist("queue", l->queue);
+        hist("device", l->device);
+        hist("total", l->total);
+    }
+}
+
+static void
+enable(char* on)
+{
+    int fd;
+
+    fd = opendev("blktrace.ev", BLKTRACE_EVENTS, O_WRONLY);
+    if (write(fd, on, 1) != 1) {
+        fprintf(stderr, "blktrace: cannot turn tracing %s\n", *on == '1' ? "on" : "off");
+        exit(1);
+    }
+    close(fd);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int i, qflag = 0, lflag = 0;
+    char* on = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-q"))
+            qflag = 1;
+        else if (!strcmp(argv[i], "-l"))
+            lflag = 1;
+        else if (!strcmp(argv[i], "-e"))
+            on = "1";
+        else if (!strcmp(argv[i], "-d"))
+            on = "0";
+        else {
+            fprintf(stderr, "usage: blktrace [-e | -d] [-q] [-l]\n");
+            exit(1);
+        }
+    }
+    if (on)
+        enable(on);
+    if (!qflag)
+        events();
+    if (!lflag)
+        latency();
+    exit(0);
+}
@@ -1,12 +1,32 @@
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/stat.h>
 
+#define dirent xv6_dirent  // avoid clash with libc struct dirent
 #include "../../../inc/fs.h"
+#undef dirent
+
+int lflag;  // -l: stat each entry for its size
+
+// The st_mode stat() reports for an entry of type t; devices get 0.
+int
+dtmode(int t)
+{
+    switch (t) {
+    case DT_REG:
+        return S_IFREG;
+    case DT_DIR:
+        return S_IFDIR;
+    default:
+        return 0;
+    }
+}
 
 char *
 fmtname(char *path)
@@ -30,8 +50,9 @@ void
 ls(char *path)
 {
     char buf[512], *p;
-    int fd;
-    struct dirent de;
+    char dbuf[2048];
+    int fd, n, off;
+    struct dirent *de;
     struct stat st;
 
     if ((fd = open(path, O_RDONLY)) < 0) {
@@ -54,16 +75,22 @@ ls(char *path)
             strcpy(buf, path);
             p = buf+strlen(buf);
             *p++ = '/';
-            while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-                if (de.inum == 0)
-                    continue;
-                memmove(p, de.name, DIRSIZ);
-                p[DIRSIZ] = 0;
-                if (stat(buf, &st) < 0) {
-                    fprintf(stderr, "ls: cannot stat %s\n", buf);
-                    continue;
+            // Read entries in batches; their type hints make a stat
+            // per entry unnecessary unless the size is wanted.
+            while ((n = getdents(fd, (struct dirent*)dbuf, sizeof(dbuf))) > 0) {
+                for (off = 0; off < n; off += de->d_reclen) {
+                    de = (struct dirent*)(dbuf + off);
+                    strcpy(p, de->d_name);
+                    if (!lflag && de->d_type != DT_UNKNOWN) {
+                        printf("%s %x %ld\n", fmtname(buf), dtmode(de->d_type), (long)de->d_ino);
+                        continue;
+                    }
+                    if (stat(buf, &st) < 0) {
+                        fprintf(stderr, "ls: cannot stat %s\n", buf);
+                        continue;
+                    }
+                    printf("%s %x %ld %ld\n", fmtname(buf), st.st_mode, st.st_ino, st.st_size);
                 }
-                printf("%s %x %ld %ld\n", fmtname(buf), st.st_mode, st.st_ino, st.st_size);
             }
         }
     }
@@ -73,9 +100,15 @@ ls(char *path)
 int
 main(int argc, char *argv[])
 {
-    if (argc < 2)
+    int i = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+        lflag = 1;
+        i++;
+    }
+    if (i == argc)
         ls(".");
-    else for (int i = 1; i < argc; i++)
+    else for (; i < argc; i++)
         ls(argv[i]);
     return 0;
 }
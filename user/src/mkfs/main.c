@@ -15,6 +15,7 @@ typedef uint32_t    uint;
 #define stat xv6_stat  // avoid clash with host struct stat
 #define sleep xv6_sleep
 #include "../../../inc/fs.h"
+#include "../../../inc/log.h"
 
 #ifndef static_assert
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
@@ -27,7 +28,7 @@ typedef uint32_t    uint;
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = NLOG;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -37,6 +38,12 @@ char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
+#define MAXROOTENT (DX_NENTRY * DX_LEAFFILL)
+#define DX_LEAFFILL (DPB * 3 / 4)   // Entries per leaf, leaving room to add
+
+struct dirent rootent[MAXROOTENT];
+int nrootent;
+
 
 void balloc(int);
 void wsect(uint, void*);
@@ -45,6 +52,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint bmapx(struct dinode *din, uint fbn);
+void wdir(uint inum, struct dirent *de, int n);
 
 // convert to little-endian byte order
 ushort
@@ -77,12 +86,26 @@ main(int argc, char *argv[])
     struct dirent de;
     char buf[BSIZE];
     struct dinode din;
+    struct logsuper ls;
+    int mode = LOG_JOURNAL;
 
 
     static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+    // -o ordered: journal only metadata, see log.h.
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        if (strcmp(argv[2], "ordered") == 0)
+            mode = LOG_ORDERED;
+        else if (strcmp(argv[2], "journal") != 0) {
+            fprintf(stderr, "mkfs: unknown journaling mode %s\n", argv[2]);
+            exit(1);
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
     if (argc < 2) {
-        fprintf(stderr, "Usage: mkfs fs.img files...\n");
+        fprintf(stderr, "Usage: mkfs [-o journal|ordered] fs.img files...\n");
         exit(1);
     }
   
@@ -119,18 +142,27 @@ main(int argc, char *argv[])
     memmove(buf, &sb, sizeof(sb));
     wsect(1, buf);
 
+    memset(&ls, 0, sizeof(ls));
+    ls.magic = xint(LOG_SUPER);
+    ls.tail = 0;
+    ls.tid = 1;
+    ls.mode = xint(mode);
+    memset(buf, 0, sizeof(buf));
+    memmove(buf, &ls, sizeof(ls));
+    wsect(2, buf);
+
     rootino = ialloc(T_DIR);
     assert(rootino == ROOTINO);
 
     bzero(&de, sizeof(de));
     de.inum = xshort(rootino);
     strcpy(de.name, ".");
-    iappend(rootino, &de, sizeof(de));
+    rootent[nrootent++] = de;
 
     bzero(&de, sizeof(de));
     de.inum = xshort(rootino);
     strcpy(de.name, "..");
-    iappend(rootino, &de, sizeof(de));
+    rootent[nrootent++] = de;
 
     for (i = 2; i < argc; i++) {
         char *path = argv[i];
@@ -161,7 +193,8 @@ main(int argc, char *argv[])
         bzero(&de, sizeof(de));
         de.inum = xshort(inum);
         strncpy(de.name, argv[i], DIRSIZ);
-        iappend(rootino, &de, sizeof(de));
+        assert(nrootent < MAXROOTENT);
+        rootent[nrootent++] = de;
 
         while ((cc = read(fd, buf, sizeof(buf))) > 0)
             iappend(inum, buf, cc);
@@ -169,10 +202,12 @@ main(int argc, char *argv[])
         close(fd);
     }
 
+    wdir(rootino, rootent, nrootent);
+
     // fix size of root inode dir
     rinode(rootino, &din);
     off = xint(din.size);
-    off = ((off/BSIZE) + 1) * BSIZE;
+    off = ((off + BSIZE - 1) / BSIZE) * BSIZE;
     din.size = xint(off);
     winode(rootino, &din);
 
@@ -266,6 +301,41 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding file block fbn of din, allocating
+// it and any indirect blocks on the way. The image starts zeroed.
+uint
+bmapx(struct dinode *din, uint fbn)
+{
+    uint indirect[NINDIRECT];
+    uint addr, span, ind;
+    int level;
+
+    if (fbn < NDIRECT) {
+        if (xint(din->addrs[fbn]) == 0)
+            din->addrs[fbn] = xint(freeblock++);
+        return xint(din->addrs[fbn]);
+    }
+    fbn -= NDIRECT;
+    for (level = 1, span = NINDIRECT; fbn >= span; level++, span *= NINDIRECT)
+        fbn -= span;
+    assert(level <= NLEVEL);
+
+    if (xint(din->addrs[NDIRECT + level - 1]) == 0)
+        din->addrs[NDIRECT + level - 1] = xint(freeblock++);
+    addr = xint(din->addrs[NDIRECT + level - 1]);
+    for (; level > 0; level--) {
+        span /= NINDIRECT;
+        ind = addr;
+        rsect(ind, (char*)indirect);
+        if (indirect[fbn / span % NINDIRECT] == 0) {
+            indirect[fbn / span % NINDIRECT] = xint(freeblock++);
+            wsect(ind, (char*)indirect);
+        }
+        addr = xint(indirect[fbn / span % NINDIRECT]);
+    }
+    return addr;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -273,31 +343,28 @@ iappend(uint inum, void *xp, int n)
     uint fbn, off, n1;
     struct dinode din;
     char buf[BSIZE];
-    uint indirect[NINDIRECT];
     uint x;
 
     rinode(inum, &din);
     off = xint(din.size);
     // printf("append inum %d at off %d sz %d\n", inum, off, n);
+    if (INLINE_DATA(xshort(din.type), off + n)) {
+        bcopy(p, (char*)din.addrs + off, n);
+        din.size = xint(off + n);
+        winode(inum, &din);
+        return;
+    }
+    if (off > 0 && INLINE_DATA(xshort(din.type), off)) {
+        // Growing past NINLINE: move the inline data to a block.
+        bzero(buf, BSIZE);
+        bcopy(din.addrs, buf, off);
+        bzero(din.addrs, sizeof(din.addrs));
+        wsect(bmapx(&din, 0), buf);
+    }
     while (n > 0) {
         fbn = off / BSIZE;
         assert(fbn < MAXFILE);
-        if (fbn < NDIRECT) {
-            if (xint(din.addrs[fbn]) == 0) {
-                din.addrs[fbn] = xint(freeblock++);
-            }
-            x = xint(din.addrs[fbn]);
-        } else {
-            if (xint(din.addrs[NDIRECT]) == 0) {
-                din.addrs[NDIRECT] = xint(freeblock++);
-            }
-            rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-            if (indirect[fbn - NDIRECT] == 0) {
-                indirect[fbn - NDIRECT] = xint(freeblock++);
-                wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-            }
-            x = xint(indirect[fbn-NDIRECT]);
-        }
+        x = bmapx(&din, fbn);
         n1 = min(n, (fbn + 1) * BSIZE - off);
         rsect(x, buf);
         bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -309,3 +376,48 @@ iappend(uint inum, void *xp, int n)
     din.size = xint(off);
     winode(inum, &din);
 }
+
+int
+hashcmp(const void *a, const void *b)
+{
+    uint x = dx_hash(((const struct dirent*)a)->name);
+    uint y = dx_hash(((const struct dirent*)b)->name);
+    return x < y ? -1 : x > y;
+}
+
+// Write the n entries de as the contents of directory inum: flat
+// if they fit in a block, else as a one-level hash tree like the
+// kernel's (see struct dxhdr), with leaves filled to DX_LEAFFILL.
+void
+wdir(uint inum, struct dirent *de, int n)
+{
+    char root[BSIZE], leaf[BSIZE];
+    struct dxhdr *h = (struct dxhdr*)root;
+    struct dxentry *e = (struct dxentry*)(h + 1);
+    struct dinode din;
+    int i, k, nleaf;
+
+    if (n <= DPB) {
+        iappend(inum, de, n * sizeof(*de));
+        return;
+    }
+
+    qsort(de, n, sizeof(*de), hashcmp);
+    bzero(root, sizeof(root));
+    iappend(inum, root, BSIZE);     // filled in below
+    h->magic = xshort(DX_MAGIC);
+    for (i = nleaf = 0; i < n; i = k, nleaf++) {
+        // Fill a leaf, but keep equal hashes together.
+        for (k = i + 1; k < n && (k - i < DX_LEAFFILL || dx_hash(de[k].name) == dx_hash(de[k - 1].name)); k++)
+            ;
+        assert(k - i <= DPB && nleaf < DX_NENTRY);
+        e[nleaf].hash = xint(i == 0 ? 0 : dx_hash(de[i].name));
+        e[nleaf].block = xint(nleaf + 1);
+        bzero(leaf, sizeof(leaf));
+        memmove(leaf, de + i, (k - i) * sizeof(*de));
+        iappend(inum, leaf, BSIZE);
+    }
+    h->count = xshort(nleaf);
+    rinode(inum, &din);
+    wsect(xint(din.addrs[0]), root);
+}